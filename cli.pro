@@ -0,0 +1,21 @@
+TEMPLATE = app
+TARGET   = krender
+CONFIG += console c++11 thread
+CONFIG -= app_bundle
+CONFIG -= qt
+
+SOURCES += \
+        src/kchannel.cpp \
+        src/kdist.cpp \
+        src/kserver.cpp \
+        src/kwatch.cpp \
+        src/main.cpp
+
+HEADERS += \
+    includes/kchannel.h \
+    includes/kdist.h \
+    includes/kserver.h \
+    includes/kwatch.h
+
+LIBS           += -L$$OUT_PWD -lkrender
+PRE_TARGETDEPS += $$OUT_PWD/libkrender.a
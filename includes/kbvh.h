@@ -0,0 +1,28 @@
+#ifndef __KRENDER_BVH_H
+#define __KRENDER_BVH_H
+
+#include <vector>
+#include "includes/krender.h"
+
+//! kbvh: bounding volume hierarchy over a model's rest-pose triangles, used to skip
+//! whole groups of faces that fall outside the region being rendered.
+
+struct BVHNode {
+    float bmin[3], bmax[3];
+    u32   first;    // Leaves: first entry of BVH::faces. Inner nodes: index of the right child (the left one follows the node)
+    u32   count;    // Number of faces in a leaf, 0 for inner nodes
+};
+
+class BVH {
+public:
+    std::vector<BVHNode> nodes;
+    std::vector<u32>     faces;     // Face indices, grouped by leaf
+
+    explicit BVH(const Model &model);
+
+    //! Appends to out, in ascending order, every face whose bounds may reach the screen-space
+    //! rectangle [x0, x1) x [y0, y1) of a width x height frame seen through camera.
+    void query(const Camera &camera, u32 width, u32 height, float x0, float y0, float x1, float y1, std::vector<u32> &out) const;
+};
+
+#endif // __KRENDER_BVH_H
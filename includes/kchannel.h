@@ -0,0 +1,53 @@
+#ifndef __KRENDER_CHANNEL_H
+#define __KRENDER_CHANNEL_H
+
+#include <chrono>
+#include <string>
+
+//! kchannel: the byte stream under the server protocol, a socket or a pair of pipes.
+//! Lines and length-prefixed payloads share one read buffer, so they can be mixed freely.
+//!
+//! Addresses are "<host>:<port>" for TCP, anything else is the path of a Unix socket.
+
+class Channel {
+public:
+    Channel(int in_fd, int out_fd) : in(in_fd), out(out_fd), expired(false) { }
+
+    //! Longest line read_line accepts, '\n' excluded
+    static const size_t MAX_LINE = 1 << 16;
+
+    //! Reads up to the next '\n', which is dropped along with a '\r' before it.
+    //! False on end of stream or error, or when no '\n' comes within MAX_LINE bytes.
+    bool read_line(std::string &line);
+    //! Reads exactly n bytes into data, which must have room for them. Whatever was not
+    //! already buffered is read straight into data.
+    bool read_bytes(size_t n, char *data);
+    bool read_bytes(size_t n, std::string &data);
+    //! Reads and discards exactly n bytes, without holding more than one read's worth.
+    bool skip_bytes(size_t n);
+    bool write(const char *data, size_t n);
+    bool write(const std::string &data) { return write(data.data(), data.size()); }
+
+    //! Reads and writes fail once deadline has passed, with timed_out() set, instead of
+    //! blocking. A default-constructed time_point removes the deadline.
+    void set_deadline(std::chrono::steady_clock::time_point deadline);
+    bool timed_out() const { return expired; }
+
+private:
+    int         in, out;
+    std::string pending;
+    std::chrono::steady_clock::time_point deadline;
+    bool        expired;
+
+    bool fill();
+    bool wait(int fd, short events);
+};
+
+//! Listening socket for address, or -1 after reporting why. TCP addresses must resolve to
+//! loopback unless any_host is set, since nothing on the socket authenticates its peers.
+int  channel_listen(const char *address, bool any_host = false);
+//! Connected socket for address, or -1 after reporting why.
+int  channel_connect(const char *address);
+bool is_tcp_address(const char *address);
+
+#endif // __KRENDER_CHANNEL_H
@@ -0,0 +1,60 @@
+#ifndef __KRENDER_COMPOSITE_H
+#define __KRENDER_COMPOSITE_H
+
+#include "includes/krender.h"
+#include "includes/kpool.h"
+
+//! kcomposite: sort-last rendering of a model split into spatial partitions.
+//!
+//! Every partition is rendered on its own, with the same camera, into a layer of color and
+//! depth. The frame is then the closest layer at every pixel: layers are merged in pairs in
+//! binary tree order as they come in (see LayerTree), each merge split into rows over the pool.
+//! Since a layer's depth can be saved and loaded (see save_depth in kio), partitions can just
+//! as well be rendered by separate processes, each holding only its own part of the mesh.
+
+struct Layer {
+    TGAImage      color;
+    vector<float> depth;    // One per pixel, rows like color's. Bigger is closer, -FLT_MAX where nothing was drawn
+};
+
+//! Splits the model's faces into n groups of nearly the same size, recursively cutting the
+//! face centroids at the median of their longest axis. Each group keeps the model's face order.
+vector<vector<u32>> partition_faces(const Model &model, int n);
+
+//! Loads only group k of partition_faces(Model(filename), n) into model, without ever holding
+//! the whole model: a first pass over the file reads just vertex positions and face corners
+//! to make the split, a second keeps the group's faces and the vertices, normals and
+//! texture coordinates they use. Faces keep their order, so the group renders as it would
+//! from the whole model.
+bool load_partition(const char *filename, int k, int n, Model &model);
+
+//! Reads a layer saved as a TGA and a depth PFM of the same size.
+bool load_layer(const char *color_file, const char *depth_file, Layer &layer, ThreadPool *pool = NULL);
+
+//! Keeps, at every pixel of into, the closer of into and from; ties keep into.
+bool composite(Layer &into, Layer &from, ThreadPool *pool = NULL);
+
+//! Composites layers handed in one at a time in binary tree order: 1 into 0, 3 into 2, then
+//! 2 into 0, and so on, each merge done as soon as both of its halves are. Only one layer per
+//! level of the tree is kept, log2(n) + 1 for n layers, rather than all of them. Ties go to
+//! the earlier layer, as if the layers had been drawn in order.
+class LayerTree {
+public:
+    explicit LayerTree(ThreadPool *p = NULL) : pool(p) { }
+
+    //! Takes layer's pixels and merges whatever pairs are complete. layer comes back holding
+    //! the buffers of a merged-away layer when there is one, ready to be drawn into again.
+    bool add(Layer &layer);
+    //! Merges the remaining levels, earliest first, into result.
+    bool finish(Layer &result);
+
+private:
+    struct Level {
+        int   height;   // 2^height layers were merged into this one
+        Layer layer;
+    };
+    vector<Level> stack;
+    ThreadPool   *pool;
+};
+
+#endif // __KRENDER_COMPOSITE_H
@@ -0,0 +1,118 @@
+#ifndef __KRENDER_CONTEXT_H
+#define __KRENDER_CONTEXT_H
+
+#include <memory>
+#include <functional>
+#include "includes/krender.h"
+#include "includes/kpool.h"
+#include "includes/kmsaa.h"
+#include "includes/kvisbuf.h"
+#include "includes/kmesh.h"
+
+//! kcontext: the embeddable entry point of libkrender.
+//!
+//! A RenderContext owns a thread pool and every scratch buffer a render needs, and holds
+//! a (possibly shared) model. Once warmed up for a given frame size, rendering into a
+//! caller-provided RenderTarget allocates nothing.
+
+//! DEFERRED resolves visibility first and shades each pixel once afterwards (see kvisbuf),
+//! with smooth lighting from the model's vertex normals when it has them.
+enum RenderMode {
+    WIREFRAME, GOURAUD, GOURAUD_Z, RANDOM_COLORS, DEFERRED
+};
+
+const char *render_mode_name(RenderMode mode);
+bool        parse_render_mode(const char *name, RenderMode &mode);
+
+//! Receives the image of each pass of a progressive render, pass 0 being the coarsest.
+typedef std::function<void(int pass, int passes, TGAImage &image)> PassCallback;
+
+class RenderContext {
+public:
+    explicit RenderContext(unsigned threads = 0);   // 0: one per hardware thread
+
+    bool load_model(const char *filename);
+    void set_model(std::shared_ptr<const Model> m);
+    std::shared_ptr<const Model> get_model() const;
+    //! Renders from a quantized mesh instead of a model (see kmesh). It replaces the model
+    //! and is replaced by set_model(). Compact meshes skip BVH culling, and cannot use DEFERRED.
+    bool load_compact_model(const char *filename);
+    void set_compact_model(std::shared_ptr<const CompactMesh> m);
+    std::shared_ptr<const CompactMesh> get_compact_model() const;
+    void set_rotation(float theta);
+    //! Zooms the frame in on (cx, cy), see Camera. Faces outside the rendered region are
+    //! culled in groups through the model's BVH before any per-face work.
+    void set_view(float cx, float cy, float zoom);
+    void set_wireframe_color(TGAColor c);
+    //! Diffuse texture for DEFERRED renders of models with texture coordinates. NULL removes it.
+    void set_texture(std::shared_ptr<const Texture> t);
+    bool load_texture(const char *filename);
+
+    //! 1 (the default) disables multisampling; 2, 4 and 8 apply to GOURAUD_Z and RANDOM_COLORS.
+    //! Multisampled renders leave target.depth untouched.
+    bool set_samples(int samples);
+
+    //! Renders a width x height frame into the clip rectangle of target, clearing it first.
+    //! If target.depth is NULL, z-buffered modes use an internal scratch buffer.
+    bool     render(RenderMode mode, u32 width, u32 height, const RenderTarget &target);
+    TGAImage render(RenderMode mode, u32 width, u32 height);
+    //! Same, drawing only the listed faces, in that order, instead of culling the whole model.
+    //! Faces that turn out not to touch target are skipped as usual; NULL is the same as render().
+    bool     render_faces(RenderMode mode, u32 width, u32 height, const RenderTarget &target, const vector<u32> *faces);
+
+    //! Renders the frame at 1/2^(passes-1) of its size first, then at twice the size of the
+    //! previous pass until width x height, handing every image to on_pass as soon as it is done.
+    //! Faces that snap to nothing at a pass's resolution are left out of it; the last pass only
+    //! leaves out those that could not have touched a pixel, so it matches render().
+    //! Preview passes are single-sampled.
+    bool     render_progressive(RenderMode mode, u32 width, u32 height, const PassCallback &on_pass, int passes = 4);
+
+    //! Renders the .OBJ at filename into n targets at once while it is being parsed, without
+    //! storing its faces (see kstream). The context's model is neither used nor replaced.
+    //! Streaming renders are always single-sampled, and cannot use DEFERRED.
+    bool     render_streaming(const char *filename, u32 width, u32 height, const RenderMode *modes, const RenderTarget *targets, int n);
+
+    //! The context's worker threads, e.g. for post-processing its images with kimage.
+    ThreadPool &thread_pool();
+
+private:
+    ThreadPool                   pool;
+    std::shared_ptr<const Model> model;
+    std::shared_ptr<const CompactMesh> mesh;
+    std::shared_ptr<const Texture> texture;
+    Camera                       camera;
+    TGAColor                     wire_color;
+    int                          samples;
+
+    // Transform stage output, reused while model, rotation and frame size stay the same
+    vector<Vec3f> world, screen;
+    bool          xf_valid;
+    u32           xf_width, xf_height;
+    float         xf_zmin, xf_zmax;
+    Vec2f         xf_min, xf_max;       // Screen-space bounds of the transformed model
+    vector<float> chunk_bounds;         // zmin, zmax, xmin, xmax, ymin, ymax per transform chunk
+
+    // Faces surviving view culling, as model indices and as vertex triplets
+    vector<u32>   visible, visible_tris;
+
+    vector<float> zscratch;
+    vector<u32>   idscratch;
+    vector<u8>    sample_color;
+    vector<u16>   sample_depth;
+
+    // Faces kept by drop_degenerate, per transform chunk and in total
+    vector<vector<u32>> chunk_faces;
+    vector<u32>   pass_faces;
+
+    // Faces of a compact mesh, decoded a block at a time by each band
+    vector<vector<u32>> band_tris;
+
+    size_t nverts() const;
+    size_t nfaces() const;
+    void transform(u32 width, u32 height);
+    bool cull(const RenderTarget &target, u32 width, u32 height, const vector<u32> *faces, MeshView &view);
+    void drop_degenerate(RenderMode mode, vector<u32> &out);
+    void render_deferred(const MeshView &view, const RenderTarget &target);
+};
+
+#endif // __KRENDER_CONTEXT_H
@@ -0,0 +1,20 @@
+#ifndef __KRENDER_DIST_H
+#define __KRENDER_DIST_H
+
+#include "includes/ktypes.h"
+
+//! kdist: spreads renders over several render servers (see kserver.h).
+//!
+//! cfg.workers is either a number of servers to start locally, each on a socket pair with
+//! its share of the hardware threads, or a comma-separated list of server addresses.
+//! The work is cfg.frames turns of the model, each cut into a cfg.tiles x cfg.tiles grid;
+//! every tile of every frame is one job. Each worker has a thread that takes jobs off a
+//! shared queue and sends them as render requests, uploading the model the first time a
+//! server does not know its content hash. Finished tiles are pasted into their frames,
+//! which are saved as soon as they are complete. A worker that fails, or that has not
+//! answered within cfg.job_timeout seconds of getting its job, hands the job back to the
+//! queue and is dropped (killed if we started it); the run fails only if every worker does.
+
+int run_coordinator(config_t cfg);
+
+#endif // __KRENDER_DIST_H
@@ -0,0 +1,27 @@
+#ifndef __KRENDER_IMAGE_H
+#define __KRENDER_IMAGE_H
+
+#include "includes/ktypes.h"
+#include "includes/kpool.h"
+
+//! kimage: whole-image operations on TGAImage buffers.
+//!
+//! Every operation works on blocks of rows, spread over pool when one is given and the
+//! image is big enough to be worth it; NULL runs on the calling thread. Flips, and conversions
+//! to fewer bytes per pixel, stay in the image's own buffer; resampling and conversions to more
+//! bytes build the new pixels in a fresh buffer and hand it to the image with TGAImage::adopt.
+//! Row loops use SSE2 where it is available, with the same arithmetic as their scalar tails.
+
+bool image_flip_vertically(TGAImage &img, ThreadPool *pool = NULL);
+bool image_flip_horizontally(TGAImage &img, ThreadPool *pool = NULL);
+
+//! Resamples img to w x h with an area (box) filter: each new pixel is the average of the
+//! part of the image it covers, weighted by how much of each old pixel lies inside it.
+//! Meant for shrinking; enlarged axes blend neighbouring pixels only at their seams.
+bool image_scale(TGAImage &img, int w, int h, ThreadPool *pool = NULL);
+
+//! Converts img between GRAYSCALE, RGB and RGBA. Gray is BT.601 luma, alpha becomes 255
+//! when added and is dropped when removed.
+bool image_convert(TGAImage &img, ColorMode mode, ThreadPool *pool = NULL);
+
+#endif // __KRENDER_IMAGE_H
@@ -2,9 +2,15 @@
 #define __KRENDER_IO_H
 
 #include <iostream>
+#include <vector>
 #include "includes/ktypes.h"
 
-bool     save_result(TGAImage img, const char *filename, bool rle=true);
+//! pool, when given, takes the row flip off the calling thread; see kimage.
+bool     save_result(TGAImage img, const char *filename, bool rle=true, ThreadPool *pool=NULL);
+bool     write_tga(TGAImage &img, std::ostream &out, bool rle=true, ThreadPool *pool=NULL);
+//! Depth buffers as grayscale PFM: width x height floats, rows bottom-up like a RenderTarget's.
+bool     save_depth(const float *depth, int width, int height, const char *filename);
+bool     load_depth(const char *filename, std::vector<float> &depth, int &width, int &height);
 config_t parse_cli_input(int argc, char ** argv);
 
 #endif // __KRENDER_IO_H
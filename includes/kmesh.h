@@ -0,0 +1,55 @@
+#ifndef __KRENDER_MESH_H
+#define __KRENDER_MESH_H
+
+#include "includes/krender.h"
+
+//! kmesh: a compact, quantized copy of a model's positions and faces.
+//!
+//! Positions are stored as 16 bits per axis relative to the model's bounding box, and are
+//! only turned back into floats by the transform stage. Faces come in clusters of
+//! CLUSTER_FACES; a cluster stores its vertex indices as 16-bit offsets from the smallest
+//! one, unless they lie too far apart, in which case it keeps them as plain 32-bit indices.
+//! That is 6 bytes per vertex instead of 12, and 6 per face instead of 12 for meshes whose
+//! faces refer to nearby vertices, as meshes written in any sensible order do.
+//! Normals and texture coordinates are not kept.
+class CompactMesh {
+public:
+    static const u32 CLUSTER_FACES = 256;
+
+    explicit CompactMesh(const Model &model);
+
+    size_t nverts() const { return pos.size() / 3; }
+    size_t nfaces() const { return faces; }
+    //! Dequantizes positions [first, first+n) into out.
+    void   positions(size_t first, size_t n, Vec3f *out) const;
+    //! Decodes the vertex indices of faces [first, first+n) into out, three per face.
+    void   face_indices(size_t first, size_t n, u32 *out) const;
+
+    //! Largest difference between a dequantized and an original coordinate, per axis.
+    Vec3f  max_error() const { return error; }
+    //! Bound on how far, in pixels, any vertex lands from where the original model would put
+    //! it in a width x height frame seen through camera. The rotation about y mixes the x and
+    //! z errors, so both count towards the horizontal one.
+    float  pixel_error(const Camera &camera, u32 width, u32 height) const;
+
+    size_t bytes() const;
+    size_t wide_clusters() const;
+    size_t nclusters() const { return clusters.size(); }
+
+private:
+    struct Cluster {
+        u32  base;          // Smallest vertex index of a narrow cluster
+        u32  offset;        // Where its indices start in narrow or wide
+        bool is_wide;
+    };
+
+    Vec3f           lo, step;   // Position = lo + q*step, per axis
+    vector<u16>     pos;        // Three quantized coordinates per vertex
+    vector<Cluster> clusters;
+    vector<u16>     narrow;
+    vector<u32>     wide;
+    size_t          faces;
+    Vec3f           error;
+};
+
+#endif // __KRENDER_MESH_H
@@ -0,0 +1,33 @@
+#ifndef __KRENDER_MSAA_H
+#define __KRENDER_MSAA_H
+
+#include "includes/krender.h"
+
+//! kmsaa: multisampled rasterization for the z-buffered passes.
+//!
+//! Coverage is evaluated at 2, 4 or 8 sub-sample positions per pixel, but each covered
+//! pixel is shaded only once per triangle. Samples are stored plane by plane (every pixel's
+//! sample 0, then every pixel's sample 1, ...) with 16-bit depth, so resolving a row is a
+//! straight sum of contiguous arrays.
+
+struct SampleTarget {
+    int     samples;        // 2, 4 or 8
+    u8     *color;          // Sample 0 of pixel (x0, y0); planes are plane_stride pixels apart
+    u16    *depth;          // Same layout as color, one u16 per sample. 0 is "nothing drawn"
+    size_t  plane_stride;   // Pixels between planes
+    int     pitch;          // Pixels between rows
+    int     bytespp;
+    int     x0, y0, x1, y1;
+    float   zmin, zscale;   // Maps z to [1, 65535], bigger is closer
+};
+
+bool     msaa_supported(int samples);
+void     msaa_clear(SampleTarget &target);
+void     msaa_triangle(const Vec3f *pts, SampleTarget &target, TGAColor color);
+void     msaa_gouraud_z_pass(const MeshView &view, SampleTarget &target);
+void     msaa_random_colors_pass(const MeshView &view, SampleTarget &target);
+
+//! Averages the samples of every pixel in target's clip rectangle into out.
+void     msaa_resolve(const SampleTarget &target, RenderTarget &out);
+
+#endif // __KRENDER_MSAA_H
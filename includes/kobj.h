@@ -0,0 +1,27 @@
+#ifndef __KRENDER_OBJ_H
+#define __KRENDER_OBJ_H
+
+#include <istream>
+#include "includes/kvec.h"
+
+//! kobj: Wavefront .OBJ reader.
+//! read_obj walks the file once and reports every element it understands to a visitor,
+//! so callers decide what to keep (see Model) or what to forward straight away (see kstream).
+
+class ObjVisitor {
+public:
+    virtual ~ObjVisitor() { }
+    virtual void vertex(const Vec3f &v)   { (void) v; }
+    virtual void texcoord(const Vec3f &t) { (void) t; }
+    virtual void normal(const Vec3f &n)   { (void) n; }
+    //! Zero-based vertex, texture and normal indices of an n-sided face
+    virtual void face(const int *verts, const int *texcoords, const int *normals, int n)
+    {
+        (void) verts; (void) texcoords; (void) normals; (void) n;
+    }
+};
+
+bool read_obj(const char *filename, ObjVisitor &visitor);
+bool read_obj(std::istream &in, ObjVisitor &visitor);
+
+#endif // __KRENDER_OBJ_H
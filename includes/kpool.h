@@ -0,0 +1,41 @@
+#ifndef __KRENDER_POOL_H
+#define __KRENDER_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//! kpool: a fixed set of worker threads that run parallel_for jobs.
+//! The calling thread takes part in every job, so a pool of size 1 spawns no threads.
+
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned threads = 0);     // 0: one per hardware thread
+    ~ThreadPool();
+    unsigned size() const;
+
+    //! Calls fn(i) for every i in [0, n), spread over the pool, and waits for all of them.
+    void parallel_for(int n, const std::function<void(int)> &fn);
+
+private:
+    std::vector<std::thread>         workers;
+    std::mutex                       lock;
+    std::condition_variable          wake, done;
+    const std::function<void(int)> * job;
+    int                              job_size;
+    std::atomic<int>                 next;
+    unsigned                         generation;
+    unsigned                         busy;
+    bool                             stopping;
+
+    void worker_loop();
+    void run_items();
+
+    ThreadPool(const ThreadPool &);
+    ThreadPool & operator =(const ThreadPool &);
+};
+
+#endif // __KRENDER_POOL_H
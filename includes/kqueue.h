@@ -0,0 +1,53 @@
+#ifndef __KRENDER_QUEUE_H
+#define __KRENDER_QUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+//! kqueue: a blocking FIFO of bounded size, for handing work between two threads.
+
+template <class T> class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t cap) : capacity(cap), closed(false) { }
+
+    //! Blocks while the queue is full. Returns false if it was closed.
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        not_full.wait(guard, [&] { return closed || items.size() < capacity; });
+        if (closed) return false;
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    //! Blocks while the queue is empty. Returns false once it is closed and drained.
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        not_empty.wait(guard, [&] { return closed || !items.empty(); });
+        if (items.empty()) return false;
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        closed = true;
+        not_full.notify_all();
+        not_empty.notify_all();
+    }
+
+private:
+    std::deque<T>           items;
+    size_t                  capacity;
+    bool                    closed;
+    std::mutex              lock;
+    std::condition_variable not_full, not_empty;
+};
+
+#endif // __KRENDER_QUEUE_H
@@ -0,0 +1,86 @@
+#ifndef __KRENDER_RASTER_H
+#define __KRENDER_RASTER_H
+
+#include <algorithm>
+#include "includes/krender.h"
+
+//! kraster: the z-buffered triangle rasterizer, specialized at compile time.
+//!
+//! Every pixel closer than target.depth is drawn and its depth recorded. Every combination of
+//! shading mode and pixel size is its own instantiation of one template, so each inner loop only
+//! contains the work its combination needs, with no per-pixel branches on the mode.
+//! raster_function() looks the instantiation up in a table; passes fetch it once and call it
+//! for every face. Only combinations some pass uses are instantiated.
+
+enum ShadeMode {
+    SHADE_FLAT,             // RasterTriangle::color everywhere
+    SHADE_ID,               // RasterTriangle::id, for 4-byte id buffers
+    SHADE_MODES
+};
+
+//! One face, already snapped to pixel centers.
+struct RasterTriangle {
+    Vec3f    pts[3];
+    TGAColor color;
+    u32      id;
+};
+
+//! How a triangle was handled, for stats. Triangles that snap to no area cover no pixel
+//! center; passes find them right after snapping and skip their shading setup, and raster
+//! functions return early for any that still reach them.
+enum RasterClass {
+    RASTER_SUBPIXEL,        // No area once snapped
+    RASTER_TINY,            // Bounding box at most RASTER_TINY_SPAN pixel centers on each side
+    RASTER_GENERAL,
+    RASTER_CLASSES
+};
+
+const int RASTER_TINY_SPAN = 4;
+
+typedef RasterClass (*RasterFunction)(const RasterTriangle &tri, RenderTarget &target);
+
+//! NULL for combinations that do not exist: SHADE_ID needs bytespp 4, and bytespp must be 3 or 4.
+RasterFunction raster_function(ShadeMode shade, int bytespp);
+
+//! Triangles per class, counted by count_raster_classes (see krender) rather than by the
+//! passes, which only see their own band and would count a face once per band it spans.
+struct RasterStats {
+    u64 triangles[RASTER_CLASSES];
+
+    RasterStats() { for (int c = 0; c < RASTER_CLASSES; c++) triangles[c] = 0; }
+    void count(RasterClass c) { triangles[c]++; }
+};
+
+void        raster_stats_add(const RasterStats &stats);
+RasterStats raster_stats();
+//! Counting takes a pass over the faces of its own, so renders only count while it is enabled.
+void        raster_stats_enable(bool on);
+bool        raster_stats_enabled();
+
+//! Pixel coordinates of a face as the z-buffered passes round them.
+inline void snap_face(const Vec3f *screen, const u32 *face, Vec3f *pts)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        const Vec3f &v = screen[face[i]];
+        pts[i] = Vec3f(int(v.x+.5), int(v.y+.5), v.z);
+    }
+}
+
+//! True when snapped points span no area, in the integers the raster functions use.
+inline bool is_subpixel(const Vec3f *pts)
+{
+    s64 ax = pts[0].x, ay = pts[0].y, bx = pts[1].x, by = pts[1].y, cx = pts[2].x, cy = pts[2].y;
+    return (cx-ax)*(by-ay) == (bx-ax)*(cy-ay);
+}
+
+//! How the raster functions classify a snapped triangle.
+inline RasterClass raster_class(const Vec3f *pts)
+{
+    if (is_subpixel(pts)) return RASTER_SUBPIXEL;
+    s64 left  = std::min(pts[0].x, std::min(pts[1].x, pts[2].x)), right = std::max(pts[0].x, std::max(pts[1].x, pts[2].x));
+    s64 lower = std::min(pts[0].y, std::min(pts[1].y, pts[2].y)), upper = std::max(pts[0].y, std::max(pts[1].y, pts[2].y));
+    return right-left < RASTER_TINY_SPAN && upper-lower < RASTER_TINY_SPAN ? RASTER_TINY : RASTER_GENERAL;
+}
+
+#endif // __KRENDER_RASTER_H
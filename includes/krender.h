@@ -1,24 +1,100 @@
 #ifndef __KRENDER_MAIN_H
 #define __KRENDER_MAIN_H
 
+#include <istream>
+#include <memory>
 #include <vector>
 #include "ktypes.h"
 #include "kvec.h"
 using std::vector;
 
+class BVH;
+
 class Model {
 public:
-    vector<Vec3f>       verts;
-    vector<vector<int>> faces;
+    vector<Vec3f> verts;
+    vector<u32>   tris;     // Three vertex indices per face
+    vector<Vec3f> norms;    // Vertex normals from the file's vn lines
+    vector<u32>   tri_norms;    // Three indices into norms per face, or empty if some face lacks them
+    vector<Vec2f> uvs;      // Texture coordinates from the file's vt lines
+    vector<u32>   tri_uvs;      // Three indices into uvs per face, or empty if some face lacks them
+    Model();
     Model(const char *filename);
+    //! Parses .OBJ data from in; name is only used in messages.
+    Model(std::istream &in, const char *name);
+    size_t nfaces() const { return tris.size() / 3; }
+    bool   has_normals() const { return !tri_norms.empty(); }
+    bool   has_texcoords() const { return !tri_uvs.empty(); }
     void rotate(float theta);
+
+    //! Built on first use and then cached with the model (see kbvh).
+    //! Call invalidate_bvh() after editing verts or tris directly.
+    std::shared_ptr<const BVH> bvh() const;
+    void invalidate_bvh();
+
+    //! Drops faces with out-of-range indices and reports the model. The constructors call
+    //! it; code that fills a model in directly (see load_partition) calls it when done.
+    void finish(const char *name);
+
+private:
+    mutable std::shared_ptr<const BVH> bvh_cache;
 };
 
-TGAImage apply_gouraud_shade_z_buffer(Model model, config_t cfg);
-TGAImage triangle_fill_random_colors(Model model, config_t cfg);
-TGAImage apply_gouraud_shade_no_z_buffer(Model model, config_t cfg);
-void     draw_triangle(Vec2i t0, Vec2i t1, Vec2i t2, TGAImage &image, TGAColor color);
-TGAImage draw_wireframe(Model model, config_t cfg, TGAColor c);
-void     draw_line(s32 x0, s32 y0, s32 x1, s32 y1, TGAImage &image, TGAColor color);
+//! Rotation about the y axis, then a zoom around (cx, cy): the region
+//! [cx-1/zoom, cx+1/zoom] x [cy-1/zoom, cy+1/zoom] of the rotated model fills the frame.
+struct Camera {
+    float theta;
+    float cx, cy;
+    float zoom;
+    Camera() : theta(0), cx(0), cy(0), zoom(1) { }
+};
+
+//! A window into caller-owned color (and optionally depth) storage.
+//! Pixel (x, y) of the frame lives at pixels + (y-y0)*pitch + (x-x0)*bytespp, so rows
+//! may be padded or stored top-down with a negative pitch. Row 0 is the bottom of the frame.
+//! Nothing outside [x0, x1) x [y0, y1) is ever written.
+struct RenderTarget {
+    u8    *pixels;
+    int    pitch;           // Bytes between rows
+    int    bytespp;         // 3 or 4, laid out as BGR(A) like TGAImage
+    float *depth;           // Depth of pixel (x0, y0), bigger is closer. May be NULL for passes without a z-buffer
+    int    depth_pitch;     // Floats between rows
+    int    x0, y0, x1, y1;
+};
+
+RenderTarget image_target(TGAImage &image, float *depth=NULL);
+
+//! A model after the transform stage, together with the faces to be drawn.
+struct MeshView {
+    const Vec3f *world;     // Rotated vertices, used for lighting
+    const Vec3f *screen;    // The same vertices in unrounded frame coordinates, z kept as is
+    const u32   *tris;
+    size_t       ntris;
+    u32          first_face;    // Index of tris[0..2] within the whole model
+    const u32   *face_ids;      // If not NULL, the model index of every face instead
+
+    u32 face_id(size_t f) const { return face_ids ? face_ids[f] : first_face + f; }
+};
+
+Vec3f    get_bar_coord(Vec3f A, Vec3f B, Vec3f C, Vec3f P);
+
+//! A stable pseudo-random color per face, so that every band of a parallel render agrees.
+TGAColor face_color(u32 face);
+float    face_intensity(const Vec3f *world, const u32 *face);
+
+void     transform_vertices(const Vec3f *in, size_t n, const Camera &camera, u32 width, u32 height, Vec3f *world, Vec3f *screen);
+
+//! Render passes. They draw on top of whatever target already holds.
+void     wireframe_pass(const MeshView &view, RenderTarget &target, TGAColor c);
+void     gouraud_pass(const MeshView &view, RenderTarget &target);
+void     gouraud_z_pass(const MeshView &view, RenderTarget &target);
+void     random_colors_pass(const MeshView &view, RenderTarget &target);
+
+//! Adds every face of view that the z-buffered passes would set up for target to the raster
+//! stats (see kraster), once however many bands target is then split into.
+void     count_raster_classes(const MeshView &view, const RenderTarget &target);
+
+void     draw_triangle(Vec2i t0, Vec2i t1, Vec2i t2, RenderTarget &target, TGAColor color);
+void     draw_line(s32 x0, s32 y0, s32 x1, s32 y1, RenderTarget &target, TGAColor color);
 
 #endif // __KRENDER_MAIN_H
@@ -0,0 +1,44 @@
+#ifndef __KRENDER_SERVER_H
+#define __KRENDER_SERVER_H
+
+#include "includes/ktypes.h"
+#include <string>
+
+//! kserver: long-running render server.
+//!
+//! The server listens on a Unix socket path, a TCP "<host>:<port>" ("*:<port>" for
+//! every interface), or stdin/stdout for "-". TCP addresses must be loopback unless
+//! cfg.allow_remote is set. Requests are single lines:
+//!     render <obj> <theta> <width> <height> [msaa=<n>] [view=<cx>,<cy>,<zoom>] [tile=<x0>,<y0>,<x1>,<y1>] <mode>=<path> [<mode>=<path> ...]
+//!     model <key> <bytes>
+//!     quit
+//! where <mode> is one of wireframe, gouraud, zbuffer, random or deferred, and <path> is
+//! either a file to be written or '-' to have the encoded TGA sent back inline.
+//! msaa=2, 4 or 8 multisamples the zbuffer and random modes. view= sets the camera as
+//! --center and --zoom do. tile= renders only that rectangle of the frame, producing an
+//! (x1-x0) x (y1-y0) image.
+//! Each render request is answered with
+//!     ok <outputs> <milliseconds>
+//! followed by one line per output, either "<mode> <path>" or "<mode> - <bytes>"
+//! immediately followed by that many bytes of TGA data. Failures are answered
+//! with a single "error <message>" line.
+//!
+//! model is followed by <bytes> bytes of .OBJ data, and <key> must be hash_key() of them.
+//! It is answered with "ok 0 <milliseconds>", after which <key> can be given as <obj>, so
+//! workers on other machines need no access to the coordinator's files.
+//!
+//! Nothing authenticates TCP clients, so they are kept away from the server's files and
+//! lifetime: their <obj> must be an uploaded key, every <path> must be '-', and quit is
+//! refused. Frames over 1 GiB, at 8 bytes per pixel and sample, are refused from anyone.
+//!
+//! Parsed models are kept in an LRU cache of cfg.cache_size entries, keyed by
+//! path and invalidated when the file's modification time changes, or by key for uploads.
+
+int    run_server(config_t cfg);
+
+//! 64-bit FNV-1a
+u64    content_hash(const char *data, size_t n);
+//! "#" and the hash in 16 hex digits, the cache key of uploaded models
+std::string hash_key(u64 hash);
+
+#endif // __KRENDER_SERVER_H
@@ -0,0 +1,52 @@
+#ifndef __KRENDER_STREAM_H
+#define __KRENDER_STREAM_H
+
+#include <thread>
+#include <vector>
+#include "includes/kqueue.h"
+#include "includes/kvec.h"
+#include "includes/ktypes.h"
+
+//! kstream: parses an .OBJ file on a background thread and hands its faces out in batches,
+//! without ever building a face list. Only the vertex array is kept; every face carries
+//! copies of its three vertices, so consumers never look at the (still growing) vertex array.
+//! Memory is bounded by depth batches of batch_size faces each.
+
+struct FaceBatch {
+    std::vector<Vec3f> verts;       // Three rest-pose vertices per face
+    u32                first_face;  // Index of the batch's first face within the file
+    size_t             nfaces;
+};
+
+class FaceStream {
+public:
+    FaceStream(const char *filename, size_t batch_size = 16384, size_t depth = 4);
+    ~FaceStream();
+
+    //! Blocks until the next batch is parsed. Returns false once the file is exhausted.
+    bool next(FaceBatch *&batch);
+    //! Hands a batch obtained from next() back to the parser for reuse.
+    void release(FaceBatch *batch);
+
+    //! Only meaningful once next() returned false.
+    bool   ok() const       { return opened; }
+    size_t vertices() const { return nverts; }
+    size_t faces() const    { return nfaces; }
+    size_t skipped() const  { return nskipped; }
+    size_t batch_size() const { return batch_faces; }
+
+private:
+    std::vector<FaceBatch>     storage;
+    BoundedQueue<FaceBatch *>  full, empty;
+    std::thread                parser;
+    size_t                     batch_faces;
+    bool                       opened;
+    size_t                     nverts, nfaces, nskipped;
+
+    void parse(const char *filename);
+
+    FaceStream(const FaceStream &);
+    FaceStream & operator =(const FaceStream &);
+};
+
+#endif // __KRENDER_STREAM_H
@@ -0,0 +1,44 @@
+#ifndef __KRENDER_TEXTURE_H
+#define __KRENDER_TEXTURE_H
+
+#include <vector>
+#include "includes/ktypes.h"
+
+//! ktexture: diffuse textures laid out for sampling rather than for storage.
+//!
+//! Every mip level is stored in 4x4 tiles of BGRA texels, so the texels a bilinear lookup
+//! touches share one 64-byte cache line most of the time, whichever way the triangle runs
+//! across the texture. The chain is built once, down to 1x1, by averaging 2x2 blocks.
+
+class Texture {
+public:
+    //! An empty texture, for which ok() is false.
+    Texture();
+    explicit Texture(TGAImage &image);
+    bool load(const char *filename);
+
+    bool ok() const         { return !mips.empty(); }
+    int  width() const      { return ok() ? mips[0].width : 0; }
+    int  height() const     { return ok() ? mips[0].height : 0; }
+    int  levels() const     { return mips.size(); }
+
+    //! Bilinear lookup at (u, v), repeated outside [0, 1], v = 0 being the bottom row, in the
+    //! mip level closest to lod (log2 of the texels of level 0 covered by one pixel).
+    TGAColor sample(float u, float v, float lod) const;
+
+private:
+    struct Level {
+        int              width, height;
+        int              tiles_x;       // Tiles per row of tiles
+        std::vector<u32> texels;        // Tile by tile, texels of a tile row by row
+    };
+    std::vector<Level> mips;
+
+    static size_t tiled_index(const Level &level, int x, int y)
+    {
+        return ((size_t) (y >> 2)*level.tiles_x + (x >> 2))*16 + (y & 3)*4 + (x & 3);
+    }
+    void build(TGAImage &image);
+};
+
+#endif // __KRENDER_TEXTURE_H
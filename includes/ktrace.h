@@ -0,0 +1,46 @@
+#ifndef __KRENDER_TRACE_H
+#define __KRENDER_TRACE_H
+
+#include <atomic>
+#include "includes/ktypes.h"
+
+//! ktrace: a timeline of what every thread spent its time on, written in Chrome's trace event
+//! format for chrome://tracing or ui.perfetto.dev.
+//!
+//! KTRACE("name") records the rest of the enclosing scope as one event, and KTRACE("name", i)
+//! also tags it with the index of the band, tile or job it worked on. Names must be string
+//! literals or otherwise outlive the process. Each thread appends to its own ring buffer
+//! without taking any lock; a thread that fills its buffer overwrites its oldest events.
+//! Nothing is recorded until trace_start(), and the file is written when the process exits.
+
+extern std::atomic<bool> trace_active;
+
+//! Starts recording, to be written to filename at exit. The calling thread is named "main".
+bool trace_start(const char *filename);
+//! Names the calling thread in the timeline; does nothing while not recording.
+void trace_thread_name(const char *name);
+//! Nanoseconds since trace_start()
+u64  trace_now();
+void trace_record(const char *name, s64 index, u64 begin, u64 end);
+
+class TraceScope {
+public:
+    explicit TraceScope(const char *what, s64 i = -1)
+        : name(what), index(i), active(trace_active.load(std::memory_order_relaxed)), begin(active ? trace_now() : 0) { }
+    ~TraceScope() { if (active) trace_record(name, index, begin, trace_now()); }
+
+private:
+    const char *name;
+    s64         index;
+    bool        active;
+    u64         begin;
+
+    TraceScope(const TraceScope &);
+    TraceScope & operator =(const TraceScope &);
+};
+
+#define KTRACE_JOIN2(a, b) a##b
+#define KTRACE_JOIN(a, b) KTRACE_JOIN2(a, b)
+#define KTRACE(...) TraceScope KTRACE_JOIN(trace_scope_, __LINE__)(__VA_ARGS__)
+
+#endif // __KRENDER_TRACE_H
@@ -42,8 +42,12 @@
 
 typedef unsigned char u8;
 typedef signed char   s8;
+typedef unsigned short u16;
+typedef signed short  s16;
 typedef unsigned int  u32;
 typedef signed int    s32;
+typedef unsigned long long u64;
+typedef signed long long   s64;
 
 struct config_s {
     char * obj_file;
@@ -51,6 +55,36 @@ struct config_s {
     u32    width;
     bool   rotation_set;
     float  rotation;
+    bool   server_mode;
+    char * socket_path;  // "-" serves on stdin/stdout
+    bool   allow_remote;    // Lets the server listen on TCP addresses other than loopback
+    u32    cache_size;
+    u32    threads;     // 0: one per hardware thread
+    u32    samples;     // MSAA samples per pixel, 1 disables it
+    bool   streaming;   // Rasterize faces while parsing instead of loading the model first
+    bool   deferred;    // Shade the z-buffered output through a visibility buffer
+    bool   compact;     // Keep the model quantized in memory (see kmesh)
+    bool   stats;       // Report how the rasterizer handled the triangles
+    bool   watch;       // Keep the outputs up to date as obj_file changes (see kwatch)
+    char * texture_file;    // Diffuse texture for the deferred output, or NULL
+    bool   progressive; // Also save coarse previews of every output as they are done
+    float  zoom;
+    float  center_x, center_y;
+    bool   crop_set;
+    u32    crop[4];     // x0, y0, x1, y1 in frame pixels
+    char * workers;     // Local worker count or server addresses, NULL renders in-process
+    u32    frames;      // Views of a full turn, rendered by the workers or into the video
+    u32    tiles;       // Each frame is split into tiles x tiles jobs
+    u32    job_timeout; // Seconds a worker gets for one job before it is dropped, 0 for no limit
+    char * video_file;  // Writes the z-buffered frames here as a video, "-" for stdout
+    u32    video_format;    // VideoFormat
+    u32    fps;
+    char * trace_file;  // Chrome trace of the whole run, written at exit
+    u32    partitions;  // Renders the z-buffered output as this many spatial partitions, composited (see kcomposite)
+    bool   partition_set;
+    u32    partition;   // With --partition k/n, only partition k of the n above is rendered
+    char * depth_file;  // Saves the z-buffered output's depth here as PFM
+    char * merge_layers;    // <tga>,<pfm>[,<tga>,<pfm>...] layers composited into the z-buffered output
 };
 typedef struct config_s config_t;
 
@@ -112,6 +146,7 @@ struct TGAColor {
     }
 };
 
+class ThreadPool;
 
 class TGAImage {
 protected:
@@ -121,15 +156,19 @@ protected:
     int bytespp;
 
 public:
-    bool   load_rle_data(std::ifstream &in);
-    bool unload_rle_data(std::ofstream &out);
+    bool   load_rle_data(const u8 *src, size_t size, bool top_down, bool right_to_left);
+    bool unload_rle_data(std::ostream &out);
     TGAImage();
     TGAImage(int w, int h, int bpp);
     TGAImage(const TGAImage &img);
     bool read_tga_file(const char *filename);
-    bool flip_horizontally();
-    bool flip_vertically();
-    bool scale(int w, int h);
+    //! Decodes a whole TGA file held in memory. Rows end up top-down, like read_tga_file's.
+    bool read_tga_memory(const u8 *src, size_t size);
+    //! Flips and scaling spread their rows over pool when one is given, see kimage.
+    bool flip_horizontally(ThreadPool *pool = NULL);
+    bool flip_vertically(ThreadPool *pool = NULL);
+    //! Area-filtered resample, see image_scale in kimage.
+    bool scale(int w, int h, ThreadPool *pool = NULL);
     TGAColor get(int x, int y);
     bool set(int x, int y, TGAColor c);
     ~TGAImage();
@@ -138,6 +177,9 @@ public:
     int get_height();
     int get_bytespp();
     u8 *buffer();
+    //! Replaces the pixels with w x h x bpp ones allocated with new[], taking ownership of them.
+    //! pixels may also be the current buffer, rewritten in place into no more bytes than it had.
+    void adopt(u8 *pixels, int w, int h, int bpp);
     void clear();
 };
 
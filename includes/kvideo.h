@@ -0,0 +1,62 @@
+#ifndef __KRENDER_VIDEO_H
+#define __KRENDER_VIDEO_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "includes/kqueue.h"
+#include "includes/ktypes.h"
+
+//! kvideo: writes rendered frames one after another to a file descriptor, usually stdout
+//! or a pipe into a video encoder, without any intermediate files.
+//!
+//! write_frame() only copies the frame into a free buffer; converting and writing it happen
+//! on a background thread while the caller renders the next one. Each frame leaves in a
+//! single write of its whole encoded size.
+
+enum VideoFormat {
+    VIDEO_Y4M,          // YUV4MPEG2, BT.601 limited range, 4:2:0 with centered chroma (C420jpeg)
+    VIDEO_RGB24         // Headerless top-down RGB, e.g. ffmpeg -f rawvideo -pix_fmt rgb24
+};
+
+class VideoWriter {
+public:
+    //! Frames must be width x height RGB images. fd is not closed.
+    VideoWriter(int fd, VideoFormat format, int width, int height, int fps = 30, size_t depth = 2);
+    ~VideoWriter();
+
+    //! Blocks while depth frames are waiting to be written. False once a write has failed.
+    bool write_frame(TGAImage &frame);
+    //! Waits until every frame is written. False if any write failed.
+    bool finish();
+
+    size_t frames() const { return nframes; }
+
+private:
+    struct Frame {
+        std::vector<u8> pixels;
+    };
+
+    std::vector<Frame>     storage;
+    BoundedQueue<Frame *>  full, empty;
+    std::thread            writer;
+    int                    fd;
+    VideoFormat            format;
+    int                    width, height, fps;
+    size_t                 nframes;
+    std::atomic<bool>      failed;
+    bool                   finished;
+    std::vector<u16>       planes[9];   // Writer thread scratch: two rows and their average, as R, G, B
+
+    void run();
+    void encode(const u8 *pixels, std::vector<u8> &out);
+    void encode_y4m(const u8 *pixels, u8 *out);
+
+    VideoWriter(const VideoWriter &);
+    VideoWriter & operator =(const VideoWriter &);
+};
+
+//! Parses "y4m" or "rgb".
+bool parse_video_format(const char *name, VideoFormat &format);
+
+#endif // __KRENDER_VIDEO_H
@@ -0,0 +1,33 @@
+#ifndef __KRENDER_VISBUF_H
+#define __KRENDER_VISBUF_H
+
+#include "includes/krender.h"
+#include "includes/ktexture.h"
+
+//! kvisbuf: visibility-buffer (deferred) shading.
+//!
+//! The raster pass only resolves visibility: every pixel ends up with the depth and the
+//! 32-bit id of the closest face. Shading then runs as a separate screen-space pass that
+//! reconstructs the barycentric coordinates of each covered pixel from its face and shades
+//! it exactly once, however many faces were drawn over it.
+
+struct VisibilityTarget {
+    u32   *ids;             // Face of pixel (x0, y0) plus one, 0 where nothing was drawn
+    int    pitch;           // u32s between rows
+    float *depth;           // Same convention as RenderTarget::depth
+    int    depth_pitch;
+    int    x0, y0, x1, y1;
+};
+
+void     visibility_clear(VisibilityTarget &target);
+//! Writes depth and model face ids (MeshView::face_id) of the faces in view.
+void     visibility_pass(const MeshView &view, VisibilityTarget &target);
+
+//! Shades every covered pixel of out's clip rectangle. world and screen are the transformed
+//! vertices of model, as used by the raster pass; theta is the rotation that produced them.
+//! Uses the model's vertex normals when it has them, its face normals otherwise. If texture
+//! is not NULL and the model has texture coordinates, the lit color modulates the texture.
+void     deferred_shade(const VisibilityTarget &vis, const Model &model, const Vec3f *world, const Vec3f *screen,
+                        float theta, const Texture *texture, RenderTarget &out);
+
+#endif // __KRENDER_VISBUF_H
@@ -0,0 +1,18 @@
+#ifndef __KRENDER_WATCH_H
+#define __KRENDER_WATCH_H
+
+#include "includes/ktypes.h"
+
+//! kwatch: keeps the outputs of cfg.obj_file up to date while it is being edited.
+//!
+//! The file is polled for a new modification time or size, and re-read once it has stopped
+//! changing. Faces are compared with the previous version by the values they refer to, not
+//! by their indices, so inserting a vertex does not dirty every face after it. The screen
+//! boxes of changed faces, before and after, mark tiles of the frame dirty; only those tiles
+//! are cleared and redrawn, from every face of the new model that overlaps them, and the
+//! outputs are saved again. Changes that affect every pixel fall back to a full render.
+//! Runs until interrupted.
+
+int run_watch(const config_t &cfg);
+
+#endif // __KRENDER_WATCH_H
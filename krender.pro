@@ -1,16 +1,9 @@
-TEMPLATE = app
-CONFIG += console c++11
-CONFIG -= app_bundle
-CONFIG -= qt
+TEMPLATE = subdirs
 
-SOURCES += \
-        src/kio.cpp \
-        src/krender.cpp \
-        src/ktypes.cpp \
-        src/main.cpp
+SUBDIRS += \
+    libkrender \
+    cli
 
-HEADERS += \
-    includes/kio.h \
-    includes/krender.h \
-    includes/ktypes.h \
-    includes/kvec.h
+libkrender.file = libkrender.pro
+cli.file        = cli.pro
+cli.depends     = libkrender
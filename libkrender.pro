@@ -0,0 +1,44 @@
+TEMPLATE = lib
+TARGET   = krender
+CONFIG += staticlib c++11 thread
+CONFIG -= qt
+
+SOURCES += \
+        src/kbvh.cpp \
+        src/kcomposite.cpp \
+        src/kcontext.cpp \
+        src/kimage.cpp \
+        src/kio.cpp \
+        src/kmesh.cpp \
+        src/kmsaa.cpp \
+        src/kobj.cpp \
+        src/kpool.cpp \
+        src/kraster.cpp \
+        src/krender.cpp \
+        src/kstream.cpp \
+        src/ktexture.cpp \
+        src/ktrace.cpp \
+        src/ktypes.cpp \
+        src/kvideo.cpp \
+        src/kvisbuf.cpp
+
+HEADERS += \
+    includes/kbvh.h \
+    includes/kcomposite.h \
+    includes/kcontext.h \
+    includes/kimage.h \
+    includes/kio.h \
+    includes/kmesh.h \
+    includes/kmsaa.h \
+    includes/kobj.h \
+    includes/kpool.h \
+    includes/kqueue.h \
+    includes/kraster.h \
+    includes/krender.h \
+    includes/kstream.h \
+    includes/ktexture.h \
+    includes/ktrace.h \
+    includes/ktypes.h \
+    includes/kvec.h \
+    includes/kvideo.h \
+    includes/kvisbuf.h
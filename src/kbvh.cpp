@@ -0,0 +1,161 @@
+#include "includes/kbvh.h"
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+//! Faces per leaf. Small enough that a leaf straddling the view border wastes little work.
+static const u32 leaf_size = 8;
+
+namespace {
+struct Builder {
+    const Model          &model;
+    std::vector<BVHNode> &nodes;
+    std::vector<u32>     &faces;
+    std::vector<Vec3f>    centroids;
+
+    Builder(const Model &m, std::vector<BVHNode> &n, std::vector<u32> &f) : model(m), nodes(n), faces(f) { }
+
+    void bounds(u32 begin, u32 end, BVHNode &node)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            node.bmin[a] =  std::numeric_limits<float>::max();
+            node.bmax[a] = -std::numeric_limits<float>::max();
+        }
+        for (u32 i = begin; i < end; i++)
+        {
+            const u32 *face = model.tris.data() + 3*faces[i];
+            for (int k = 0; k < 3; k++)
+            {
+                const Vec3f &v = model.verts[face[k]];
+                for (int a = 0; a < 3; a++)
+                {
+                    node.bmin[a] = std::min(node.bmin[a], v.raw[a]);
+                    node.bmax[a] = std::max(node.bmax[a], v.raw[a]);
+                }
+            }
+        }
+    }
+
+    //! Builds the subtree over faces[begin, end) and returns its node index
+    u32 build(u32 begin, u32 end)
+    {
+        u32 index = nodes.size();
+        nodes.push_back(BVHNode());
+        bounds(begin, end, nodes[index]);
+        nodes[index].first = begin;
+        nodes[index].count = end - begin;
+        if (end - begin <= leaf_size)
+        {
+            return index;
+        }
+
+        // Median split along the widest axis of the face centroids
+        float cmin[3], cmax[3];
+        for (int a = 0; a < 3; a++)
+        {
+            cmin[a] =  std::numeric_limits<float>::max();
+            cmax[a] = -std::numeric_limits<float>::max();
+        }
+        for (u32 i = begin; i < end; i++)
+        {
+            for (int a = 0; a < 3; a++)
+            {
+                cmin[a] = std::min(cmin[a], centroids[faces[i]].raw[a]);
+                cmax[a] = std::max(cmax[a], centroids[faces[i]].raw[a]);
+            }
+        }
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+        {
+            if (cmax[a]-cmin[a] > cmax[axis]-cmin[axis]) axis = a;
+        }
+        u32 mid = begin + (end - begin)/2;
+        std::nth_element(faces.begin() + begin, faces.begin() + mid, faces.begin() + end, [&](u32 a, u32 b) {
+            return centroids[a].raw[axis] < centroids[b].raw[axis];
+        });
+
+        build(begin, mid);
+        u32 right = build(mid, end);
+        nodes[index].count = 0;
+        nodes[index].first = right;
+        return index;
+    }
+};
+}
+
+BVH::BVH(const Model &model)
+{
+    size_t n = model.nfaces();
+    faces.resize(n);
+    if (!n)
+    {
+        return;
+    }
+    Builder builder(model, nodes, faces);
+    builder.centroids.resize(n);
+    for (size_t f = 0; f < n; f++)
+    {
+        faces[f] = f;
+        const u32 *face = model.tris.data() + 3*f;
+        builder.centroids[f] = (model.verts[face[0]] + model.verts[face[1]] + model.verts[face[2]]) * (1.f/3);
+    }
+    nodes.reserve(2*n/leaf_size + 1);
+    builder.build(0, n);
+}
+
+//! Range of the leaf faces below node, which are always contiguous
+static void subtree_range(const std::vector<BVHNode> &nodes, u32 index, u32 &begin, u32 &end)
+{
+    u32 left = index, right = index;
+    while (!nodes[left].count)  left  = left + 1;
+    while (!nodes[right].count) right = nodes[right].first;
+    begin = nodes[left].first;
+    end   = nodes[right].first + nodes[right].count;
+}
+
+void BVH::query(const Camera &camera, u32 width, u32 height, float x0, float y0, float x1, float y1, std::vector<u32> &out) const
+{
+    if (nodes.empty())
+    {
+        return;
+    }
+    size_t first_out = out.size();
+    float cos_theta = cos(camera.theta), sin_theta = sin(camera.theta);
+
+    u32 stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while (top)
+    {
+        u32 index = stack[--top];
+        const BVHNode &node = nodes[index];
+
+        // Interval arithmetic through the rotation about y, then the (monotonic) screen mapping
+        float ax = node.bmin[0]*cos_theta, bx = node.bmax[0]*cos_theta;
+        float az = -node.bmax[2]*sin_theta, bz = -node.bmin[2]*sin_theta;
+        float rx_min = std::min(ax, bx) + std::min(az, bz);
+        float rx_max = std::max(ax, bx) + std::max(az, bz);
+        float min_x = ((rx_min - camera.cx)*camera.zoom + 1.f)*width/2.f;
+        float max_x = ((rx_max - camera.cx)*camera.zoom + 1.f)*width/2.f;
+        float min_y = ((node.bmin[1] - camera.cy)*camera.zoom + 1.f)*height/2.f;
+        float max_y = ((node.bmax[1] - camera.cy)*camera.zoom + 1.f)*height/2.f;
+
+        // A pixel of slack on each side covers the rasterizers' rounding
+        if (max_x < x0-1 || min_x >= x1+1 || max_y < y0-1 || min_y >= y1+1)
+        {
+            continue;
+        }
+        bool inside = min_x >= x0+1 && max_x < x1-1 && min_y >= y0+1 && max_y < y1-1;
+        if (node.count || inside || top + 2 > 64)
+        {
+            u32 begin, end;
+            subtree_range(nodes, index, begin, end);
+            out.insert(out.end(), faces.begin() + begin, faces.begin() + end);
+            continue;
+        }
+        stack[top++] = node.first;
+        stack[top++] = index + 1;
+    }
+    std::sort(out.begin() + first_out, out.end());
+}
@@ -0,0 +1,253 @@
+#include "includes/kchannel.h"
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using std::cerr;
+
+void Channel::set_deadline(std::chrono::steady_clock::time_point when)
+{
+    deadline = when;
+    expired  = false;
+}
+
+//! Waits until fd is ready for events or the deadline passes; true right away without one.
+bool Channel::wait(int fd, short events)
+{
+    if (deadline == std::chrono::steady_clock::time_point())
+        return true;
+    for (;;)
+    {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        pollfd p = { fd, events, 0 };
+        int n = left > 0 ? poll(&p, 1, (int) std::min<long long>(left, 1 << 30)) : 0;
+        if (n < 0 && errno == EINTR) continue;
+        if (n > 0) return true;
+        expired = !n;
+        return false;
+    }
+}
+
+bool Channel::fill()
+{
+    char buf[65536];
+    for (;;)
+    {
+        if (!wait(in, POLLIN)) return false;
+        ssize_t n = ::read(in, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        pending.append(buf, n);
+        return true;
+    }
+}
+
+bool Channel::read_line(std::string &line)
+{
+    size_t nl, searched = 0;
+    while ((nl = pending.find('\n', searched)) == std::string::npos && pending.size() <= MAX_LINE)
+    {
+        searched = pending.size();
+        if (!fill()) return false;
+    }
+    if (nl == std::string::npos || nl > MAX_LINE)
+    {
+        cerr << "krender: error: line over " << MAX_LINE << " bytes, closing the connection.\n";
+        return false;
+    }
+    line.assign(pending, 0, nl);
+    pending.erase(0, nl + 1);
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    return true;
+}
+
+bool Channel::read_bytes(size_t n, char *data)
+{
+    size_t buffered = std::min(n, pending.size());
+    memcpy(data, pending.data(), buffered);
+    pending.erase(0, buffered);
+    for (size_t got = buffered; got < n; )
+    {
+        if (!wait(in, POLLIN)) return false;
+        ssize_t r = ::read(in, data + got, n - got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        got += r;
+    }
+    return true;
+}
+
+bool Channel::read_bytes(size_t n, std::string &data)
+{
+    data.resize(n);
+    return !n || read_bytes(n, &data[0]);
+}
+
+bool Channel::skip_bytes(size_t n)
+{
+    for (;;)
+    {
+        size_t drop = std::min(n, pending.size());
+        pending.erase(0, drop);
+        n -= drop;
+        if (!n) return true;
+        if (!fill()) return false;
+    }
+}
+
+bool Channel::write(const char *data, size_t len)
+{
+    while (len)
+    {
+        if (!wait(out, POLLOUT)) return false;
+        ssize_t n = ::write(out, data, len);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len  -= n;
+    }
+    return true;
+}
+
+bool is_tcp_address(const char *address)
+{
+    const char *colon = strrchr(address, ':');
+    return colon && colon != address && colon[1] && !strchr(address, '/');
+}
+
+static bool unix_address(const char *path, sockaddr_un &addr)
+{
+    memset((void *)&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        cerr << "krender: socket path \"" << path << "\" is too long.\n";
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    return true;
+}
+
+//! Resolves a TCP address and returns the first socket that connect_or_bind accepts.
+template <typename F>
+static int tcp_socket(const char *address, bool passive, F connect_or_bind)
+{
+    std::string host(address, strrchr(address, ':'));
+    const char *port = strrchr(address, ':') + 1;
+    addrinfo hints, *found;
+    memset((void *)&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = passive ? AI_PASSIVE : 0;
+    int err = getaddrinfo(host == "*" ? NULL : host.c_str(), port, &hints, &found);
+    if (err)
+    {
+        cerr << "krender: couldn't resolve \"" << address << "\": " << gai_strerror(err) << "\n";
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo *ai = found; ai && fd < 0; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd >= 0 && !connect_or_bind(fd, ai->ai_addr, ai->ai_addrlen))
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(found);
+    return fd;
+}
+
+static bool is_loopback(const sockaddr *addr)
+{
+    if (addr->sa_family == AF_INET)
+    {
+        return (ntohl(((const sockaddr_in *) addr)->sin_addr.s_addr) >> 24) == 127;
+    }
+    return addr->sa_family == AF_INET6 && IN6_IS_ADDR_LOOPBACK(&((const sockaddr_in6 *) addr)->sin6_addr);
+}
+
+int channel_listen(const char *address, bool any_host)
+{
+    int fd;
+    if (is_tcp_address(address))
+    {
+        bool refused = false;
+        fd = tcp_socket(address, true, [&](int fd, const sockaddr *addr, socklen_t len) {
+            if (!any_host && !is_loopback(addr))
+            {
+                refused = true;
+                return false;
+            }
+            int on = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            return !bind(fd, addr, len) && !listen(fd, 16);
+        });
+        if (fd < 0 && refused)
+        {
+            cerr << "krender: refusing to listen on \"" << address << "\": not a loopback address (see --allow-remote).\n";
+            return -1;
+        }
+    }
+    else
+    {
+        sockaddr_un addr;
+        if (!unix_address(address, addr))
+            return -1;
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(address);
+        if (fd >= 0 && (bind(fd, (sockaddr *)&addr, sizeof(addr)) || listen(fd, 16)))
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0)
+        cerr << "krender: couldn't listen on \"" << address << "\": " << strerror(errno) << "\n";
+    return fd;
+}
+
+int channel_connect(const char *address)
+{
+    int fd;
+    if (is_tcp_address(address))
+    {
+        fd = tcp_socket(address, false, [](int fd, const sockaddr *addr, socklen_t len) {
+            return !connect(fd, addr, len);
+        });
+        if (fd >= 0)
+        {
+            // Requests are small and answered one at a time
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+    }
+    else
+    {
+        sockaddr_un addr;
+        if (!unix_address(address, addr))
+            return -1;
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (sockaddr *)&addr, sizeof(addr)))
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0)
+        cerr << "krender: couldn't connect to \"" << address << "\": " << strerror(errno) << "\n";
+    return fd;
+}
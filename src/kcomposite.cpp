@@ -0,0 +1,309 @@
+#include "includes/kcomposite.h"
+#include "includes/kio.h"
+#include "includes/kobj.h"
+#include "includes/ktrace.h"
+#include <string.h>
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+using std::cerr;
+
+namespace {
+
+//! Rows per block when a merge is split over the pool
+const int COMPOSITE_ROWS = 64;
+
+void split(vector<u32>::iterator begin, vector<u32>::iterator end, int n,
+           const vector<Vec3f> &centroids, vector<vector<u32>> &parts)
+{
+    if (n == 1)
+    {
+        parts.push_back(vector<u32>(begin, end));
+        std::sort(parts.back().begin(), parts.back().end());
+        return;
+    }
+    Vec3f lo( std::numeric_limits<float>::max(),  std::numeric_limits<float>::max(),  std::numeric_limits<float>::max());
+    Vec3f hi(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+    for (auto f = begin; f != end; ++f)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            lo.raw[a] = std::min(lo.raw[a], centroids[*f].raw[a]);
+            hi.raw[a] = std::max(hi.raw[a], centroids[*f].raw[a]);
+        }
+    }
+    int axis = 0;
+    for (int a = 1; a < 3; a++)
+    {
+        if (hi.raw[a] - lo.raw[a] > hi.raw[axis] - lo.raw[axis]) axis = a;
+    }
+    // The two halves get faces in proportion to their share of the partitions
+    int    left = n / 2;
+    auto   mid  = begin + (end - begin) * left / n;
+    std::nth_element(begin, mid, end, [&](u32 a, u32 b) {
+        float ca = centroids[a].raw[axis], cb = centroids[b].raw[axis];
+        return ca < cb || (ca == cb && a < b);
+    });
+    split(begin, mid, left, centroids, parts);
+    split(mid, end, n - left, centroids, parts);
+}
+
+void composite_rows(Layer &into, Layer &from, int y0, int y1)
+{
+    const int    width = into.color.get_width(), bpp = into.color.get_bytespp();
+    const size_t row   = (size_t) width*bpp;
+    for (int y = y0; y < y1; y++)
+    {
+        float       *zi = into.depth.data() + (size_t) y*width;
+        const float *zf = from.depth.data() + (size_t) y*width;
+        u8       *ci = into.color.buffer() + y*row;
+        const u8 *cf = from.color.buffer() + y*row;
+        for (int x = 0; x < width; x++)
+        {
+            if (zf[x] > zi[x])
+            {
+                zi[x] = zf[x];
+                memcpy(ci + x*bpp, cf + x*bpp, bpp);
+            }
+        }
+    }
+}
+
+//! Splits faces, given by their centroids, as partition_faces does
+vector<vector<u32>> partition(const vector<Vec3f> &centroids, int n)
+{
+    vector<u32> order(centroids.size());
+    std::iota(order.begin(), order.end(), 0);
+    vector<vector<u32>> parts;
+    parts.reserve(std::max(n, 1));
+    split(order.begin(), order.end(), std::max(n, 1), centroids, parts);
+    return parts;
+}
+
+//! First pass of load_partition: vertex positions and face corners, nothing else
+class CornerReader : public ObjVisitor {
+public:
+    vector<Vec3f> verts;
+    vector<int>   corners;   // Three per face, as in the file
+    void vertex(const Vec3f &v) { verts.push_back(v); }
+    void face(const int *v, const int *texcoords, const int *normals, int n)
+    {
+        (void) texcoords; (void) normals;
+        if (n >= 3) corners.insert(corners.end(), v, v+3);
+    }
+};
+
+const u32 UNUSED = std::numeric_limits<u32>::max();
+
+//! Second pass: keeps the faces marked in keep and the vertices that have a new index in remap.
+//! Normals and texture coordinates are all kept, to be compacted once every face was seen.
+class PartitionReader : public ObjVisitor {
+public:
+    Model              &model;
+    const vector<bool> &keep;
+    const vector<u32>  &remap;
+    size_t              nverts, nfaces;
+
+    PartitionReader(Model &m, const vector<bool> &k, const vector<u32> &r) : model(m), keep(k), remap(r), nverts(0), nfaces(0) { }
+    void vertex(const Vec3f &v)
+    {
+        if (nverts < remap.size() && remap[nverts] != UNUSED) model.verts.push_back(v);
+        nverts++;
+    }
+    void normal(const Vec3f &n)   { model.norms.push_back(n); }
+    void texcoord(const Vec3f &t) { model.uvs.push_back(Vec2f(t.x, t.y)); }
+    void face(const int *v, const int *texcoords, const int *normals, int n)
+    {
+        if (n < 3 || nfaces >= keep.size() || !keep[nfaces++]) return;
+        for (int c = 0; c < 3; c++)
+        {
+            model.tris.push_back(remap[v[c]]);
+            model.tri_norms.push_back(normals[c]);
+            model.tri_uvs.push_back(texcoords[c]);
+        }
+    }
+};
+
+//! Drops the values no index refers to, renumbering the indices. Left alone when an index is out
+//! of range, for Model::finish to drop them all.
+template <typename T>
+void compact(vector<T> &values, vector<u32> &indices)
+{
+    vector<u32> remap(values.size(), UNUSED);
+    for (u32 i : indices)
+    {
+        if (i >= values.size()) return;
+        remap[i] = 0;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        if (remap[i] == UNUSED) continue;
+        remap[i] = kept;
+        values[kept++] = values[i];
+    }
+    values.resize(kept);
+    values.shrink_to_fit();
+    for (u32 &i : indices) i = remap[i];
+}
+
+bool compatible(Layer &a, Layer &b)
+{
+    if (a.color.get_width() != b.color.get_width() || a.color.get_height() != b.color.get_height() || a.color.get_bytespp() != b.color.get_bytespp())
+    {
+        cerr << "krender: error: can't composite a " << b.color.get_width() << " x " << b.color.get_height() << " layer into a "
+             << a.color.get_width() << " x " << a.color.get_height() << " one.\n";
+        return false;
+    }
+    size_t pixels = (size_t) a.color.get_width()*a.color.get_height();
+    if (a.depth.size() != pixels || b.depth.size() != pixels)
+    {
+        cerr << "krender: error: layer depth does not match its color image.\n";
+        return false;
+    }
+    return true;
+}
+
+}
+
+vector<vector<u32>> partition_faces(const Model &model, int n)
+{
+    KTRACE("partition");
+    size_t nfaces = model.nfaces();
+    vector<Vec3f> centroids(nfaces);
+    for (size_t f = 0; f < nfaces; f++)
+    {
+        const u32 *face = model.tris.data() + 3*f;
+        centroids[f] = model.verts[face[0]] + model.verts[face[1]] + model.verts[face[2]];
+    }
+    return partition(centroids, n);
+}
+
+bool load_partition(const char *filename, int k, int n, Model &model)
+{
+    KTRACE("load partition");
+    vector<bool> keep;
+    vector<u32>  remap;
+    {
+        CornerReader corners;
+        if (!read_obj(filename, corners))
+        {
+            return false;
+        }
+        // Faces are numbered as in a loaded Model, which drops the ones with unknown vertices
+        const size_t nverts = corners.verts.size(), nfaces = corners.corners.size() / 3;
+        vector<u32>   valid;
+        vector<Vec3f> centroids;
+        for (size_t f = 0; f < nfaces; f++)
+        {
+            const int *face = corners.corners.data() + 3*f;
+            if ((u32) face[0] >= nverts || (u32) face[1] >= nverts || (u32) face[2] >= nverts)
+                continue;
+            valid.push_back(f);
+            centroids.push_back(corners.verts[face[0]] + corners.verts[face[1]] + corners.verts[face[2]]);
+        }
+        vector<u32> group = std::move(partition(centroids, n)[k]);
+        vector<Vec3f>().swap(centroids);
+
+        keep.assign(nfaces, false);
+        remap.assign(nverts, UNUSED);
+        for (u32 g : group)
+        {
+            keep[valid[g]] = true;
+            const int *face = corners.corners.data() + 3*valid[g];
+            for (int c = 0; c < 3; c++) remap[face[c]] = 0;
+        }
+        u32 used = 0;
+        for (u32 &r : remap)
+        {
+            if (r != UNUSED) r = used++;
+        }
+    }
+
+    PartitionReader reader(model, keep, remap);
+    if (!read_obj(filename, reader))
+    {
+        return false;
+    }
+    compact(model.norms, model.tri_norms);
+    compact(model.uvs, model.tri_uvs);
+    model.finish((std::string(filename) + " partition " + std::to_string(k) + "/" + std::to_string(n)).c_str());
+    return true;
+}
+
+bool load_layer(const char *color_file, const char *depth_file, Layer &layer, ThreadPool *pool)
+{
+    int width, height;
+    if (!layer.color.read_tga_file(color_file) || !load_depth(depth_file, layer.depth, width, height))
+    {
+        return false;
+    }
+    if (width != layer.color.get_width() || height != layer.color.get_height())
+    {
+        cerr << "krender: error: \"" << depth_file << "\" is " << width << " x " << height << " but \"" << color_file
+             << "\" is " << layer.color.get_width() << " x " << layer.color.get_height() << ".\n";
+        return false;
+    }
+    // Decoded TGAs are top-down, layers bottom-up
+    layer.color.flip_vertically(pool);
+    return true;
+}
+
+bool composite(Layer &into, Layer &from, ThreadPool *pool)
+{
+    if (!compatible(into, from))
+    {
+        return false;
+    }
+    KTRACE("composite");
+    int height = into.color.get_height();
+    int blocks = pool ? (height + COMPOSITE_ROWS - 1) / COMPOSITE_ROWS : 1;
+    if (blocks <= 1)
+    {
+        composite_rows(into, from, 0, height);
+        return true;
+    }
+    pool->parallel_for(blocks, [&](int i) {
+        composite_rows(into, from, i*COMPOSITE_ROWS, std::min(height, (i + 1)*COMPOSITE_ROWS));
+    });
+    return true;
+}
+
+bool LayerTree::add(Layer &layer)
+{
+    stack.push_back(Level());
+    stack.back().height = 0;
+    std::swap(stack.back().layer, layer);
+    while (stack.size() > 1 && stack[stack.size()-2].height == stack.back().height)
+    {
+        Level &into = stack[stack.size()-2];
+        if (!composite(into.layer, stack.back().layer, pool))
+        {
+            return false;
+        }
+        into.height++;
+        std::swap(layer, stack.back().layer);
+        stack.pop_back();
+    }
+    return true;
+}
+
+bool LayerTree::finish(Layer &result)
+{
+    if (stack.empty())
+    {
+        return true;
+    }
+    // The levels left are whole subtrees, earliest at the bottom, so they merge from the top down
+    for (size_t i = stack.size() - 1; i > 0; i--)
+    {
+        if (!composite(stack[i-1].layer, stack[i].layer, pool))
+        {
+            return false;
+        }
+    }
+    std::swap(result, stack[0].layer);
+    stack.clear();
+    return true;
+}
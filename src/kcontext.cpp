@@ -0,0 +1,693 @@
+#include "includes/kcontext.h"
+#include "includes/kstream.h"
+#include "includes/kbvh.h"
+#include "includes/kraster.h"
+#include "includes/ktrace.h"
+#include <iostream>
+#include <limits>
+#include <string.h>
+#include <algorithm>
+
+using std::cerr;
+
+//! Faces of a compact mesh decoded at a time, and vertices dequantized at a time
+static const size_t block_faces = 4096;
+static const size_t block_verts = 1024;
+
+static const char *mode_names[] = { "wireframe", "gouraud", "zbuffer", "random", "deferred" };
+
+const char *render_mode_name(RenderMode mode)
+{
+    return mode_names[mode];
+}
+
+bool parse_render_mode(const char *name, RenderMode &mode)
+{
+    for (int i = 0; i < (int) (sizeof(mode_names)/sizeof(*mode_names)); i++)
+    {
+        if (!strcmp(name, mode_names[i]))
+        {
+            mode = (RenderMode) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool is_z_buffered(RenderMode mode)
+{
+    return mode == GOURAUD_Z || mode == RANDOM_COLORS || mode == DEFERRED;
+}
+
+RenderContext::RenderContext(unsigned threads)
+    : pool(threads), wire_color(255, 255, 255, 255), samples(1),
+      xf_valid(false), xf_width(0), xf_height(0), xf_zmin(0), xf_zmax(0),
+      chunk_bounds(6*pool.size())
+{
+}
+
+bool RenderContext::load_model(const char *filename)
+{
+    KTRACE("load model");
+    std::shared_ptr<Model> m = std::make_shared<Model>(filename);
+    if (m->verts.empty())
+    {
+        return false;
+    }
+    set_model(m);
+    return true;
+}
+
+void RenderContext::set_model(std::shared_ptr<const Model> m)
+{
+    model    = m;
+    mesh     = NULL;
+    xf_valid = false;
+}
+
+std::shared_ptr<const Model> RenderContext::get_model() const
+{
+    return model;
+}
+
+bool RenderContext::load_compact_model(const char *filename)
+{
+    KTRACE("load compact model");
+    // The full model only lives until it is quantized
+    std::shared_ptr<CompactMesh> m;
+    {
+        Model full(filename);
+        if (full.verts.empty())
+        {
+            return false;
+        }
+        m = std::make_shared<CompactMesh>(full);
+    }
+    set_compact_model(m);
+    return true;
+}
+
+void RenderContext::set_compact_model(std::shared_ptr<const CompactMesh> m)
+{
+    mesh     = m;
+    model    = NULL;
+    xf_valid = false;
+}
+
+std::shared_ptr<const CompactMesh> RenderContext::get_compact_model() const
+{
+    return mesh;
+}
+
+size_t RenderContext::nverts() const
+{
+    return model ? model->verts.size() : mesh->nverts();
+}
+
+size_t RenderContext::nfaces() const
+{
+    return model ? model->nfaces() : mesh->nfaces();
+}
+
+void RenderContext::set_rotation(float t)
+{
+    if (t != camera.theta) xf_valid = false;
+    camera.theta = t;
+}
+
+void RenderContext::set_view(float cx, float cy, float zoom)
+{
+    if (cx != camera.cx || cy != camera.cy || zoom != camera.zoom) xf_valid = false;
+    camera.cx   = cx;
+    camera.cy   = cy;
+    camera.zoom = zoom;
+}
+
+void RenderContext::set_wireframe_color(TGAColor c)
+{
+    wire_color = c;
+}
+
+void RenderContext::set_texture(std::shared_ptr<const Texture> t)
+{
+    texture = t;
+}
+
+bool RenderContext::load_texture(const char *filename)
+{
+    KTRACE("load texture");
+    std::shared_ptr<Texture> t = std::make_shared<Texture>();
+    if (!t->load(filename))
+    {
+        cerr << "krender: error: could not read texture \"" << filename << "\".\n";
+        return false;
+    }
+    set_texture(t);
+    return true;
+}
+
+bool RenderContext::set_samples(int n)
+{
+    if (n != 1 && !msaa_supported(n))
+    {
+        cerr << "krender: error: unsupported sample count " << n << ", expected 1, 2, 4 or 8.\n";
+        return false;
+    }
+    samples = n;
+    return true;
+}
+
+ThreadPool &RenderContext::thread_pool()
+{
+    return pool;
+}
+
+void RenderContext::transform(u32 width, u32 height)
+{
+    if (xf_valid && xf_width == width && xf_height == height)
+    {
+        return;
+    }
+    KTRACE("transform");
+    size_t n = nverts();
+    world.resize(n);
+    screen.resize(n);
+    int chunks = std::min<size_t>(pool.size(), n / 4096 + 1);
+    pool.parallel_for(chunks, [&](int i) {
+        KTRACE("transform chunk", i);
+        size_t begin = n * i / chunks, end = n * (i+1) / chunks;
+        if (model)
+        {
+            transform_vertices(model->verts.data() + begin, end - begin, camera, width, height,
+                               world.data() + begin, screen.data() + begin);
+        }
+        else
+        {
+            Vec3f rest[block_verts];
+            for (size_t v = begin; v < end; v += block_verts)
+            {
+                size_t count = std::min(block_verts, end - v);
+                mesh->positions(v, count, rest);
+                transform_vertices(rest, count, camera, width, height, world.data() + v, screen.data() + v);
+            }
+        }
+        float *b = chunk_bounds.data() + 6*i;
+        b[0] = b[2] = b[4] =  std::numeric_limits<float>::max();
+        b[1] = b[3] = b[5] = -std::numeric_limits<float>::max();
+        for (size_t v = begin; v < end; v++)
+        {
+            b[0] = std::min(b[0], world[v].z);
+            b[1] = std::max(b[1], world[v].z);
+            b[2] = std::min(b[2], screen[v].x);
+            b[3] = std::max(b[3], screen[v].x);
+            b[4] = std::min(b[4], screen[v].y);
+            b[5] = std::max(b[5], screen[v].y);
+        }
+    });
+    const float *b = chunk_bounds.data();
+    xf_zmin = b[0]; xf_zmax = b[1];
+    xf_min  = Vec2f(b[2], b[4]);
+    xf_max  = Vec2f(b[3], b[5]);
+    for (int i = 1; i < chunks; i++)
+    {
+        b = chunk_bounds.data() + 6*i;
+        xf_zmin  = std::min(xf_zmin,  b[0]);
+        xf_zmax  = std::max(xf_zmax,  b[1]);
+        xf_min.x = std::min(xf_min.x, b[2]);
+        xf_max.x = std::max(xf_max.x, b[3]);
+        xf_min.y = std::min(xf_min.y, b[4]);
+        xf_max.y = std::max(xf_max.y, b[5]);
+    }
+    xf_valid  = true;
+    xf_width  = width;
+    xf_height = height;
+}
+
+//! Fills view with the faces that may touch target: the given faces if any, otherwise the whole
+//! model, going through the BVH if it reaches outside of target. Returns whether any face was culled.
+//! A compact mesh drawn whole is left encoded, with view.tris NULL (see for_each_block).
+bool RenderContext::cull(const RenderTarget &target, u32 width, u32 height, const vector<u32> *faces, MeshView &view)
+{
+    KTRACE("cull");
+    view.world      = world.data();
+    view.screen     = screen.data();
+    view.tris       = model ? model->tris.data() : NULL;
+    view.ntris      = nfaces();
+    view.first_face = 0;
+    view.face_ids   = NULL;
+
+    if (faces)
+    {
+        visible = *faces;
+    }
+    else
+    {
+        if (!model || (xf_min.x >= target.x0+1 && xf_max.x < target.x1-1 && xf_min.y >= target.y0+1 && xf_max.y < target.y1-1))
+        {
+            return false;
+        }
+        visible.clear();
+        model->bvh()->query(camera, width, height, target.x0, target.y0, target.x1, target.y1, visible);
+    }
+    if (visible.size() == nfaces())
+    {
+        return false;
+    }
+    visible_tris.resize(3*visible.size());
+    for (size_t i = 0; i < visible.size(); i++)
+    {
+        if (!model)
+        {
+            mesh->face_indices(visible[i], 1, visible_tris.data() + 3*i);
+            continue;
+        }
+        const u32 *face = model->tris.data() + 3*visible[i];
+        visible_tris[3*i]   = face[0];
+        visible_tris[3*i+1] = face[1];
+        visible_tris[3*i+2] = face[2];
+    }
+    view.tris     = visible_tris.data();
+    view.ntris    = visible.size();
+    view.face_ids = visible.data();
+    return true;
+}
+
+//! Lists, in order, the faces that keep some area once snapped to pixels the way mode's raster
+//! pass snaps them: rounded for the z-buffered passes, truncated for the others.
+void RenderContext::drop_degenerate(RenderMode mode, vector<u32> &out)
+{
+    KTRACE("drop degenerate");
+    bool rounded = is_z_buffered(mode);
+    size_t n = nfaces();
+    int chunks = std::min<size_t>(pool.size(), n / 16384 + 1);
+    chunk_faces.resize(chunks);
+    pool.parallel_for(chunks, [&](int i) {
+        KTRACE("drop degenerate chunk", i);
+        vector<u32> &kept = chunk_faces[i];
+        kept.clear();
+        const float bias = rounded ? .5f : 0;
+        vector<u32> decoded(model ? 0 : 3*block_faces);
+        size_t end = n * (i+1) / chunks;
+        for (size_t first = n * i / chunks; first < end; )
+        {
+            size_t count = model ? end - first : std::min(block_faces, end - first);
+            const u32 *tris = model ? model->tris.data() + 3*first : decoded.data();
+            if (!model)
+            {
+                mesh->face_indices(first, count, decoded.data());
+            }
+            for (size_t k = 0; k < count; k++)
+            {
+                const u32 *face = tris + 3*k;
+                const Vec3f &a = screen[face[0]], &b = screen[face[1]], &c = screen[face[2]];
+                s64 ax = int(a.x+bias), ay = int(a.y+bias), bx = int(b.x+bias), by = int(b.y+bias), cx = int(c.x+bias), cy = int(c.y+bias);
+                if ((cx-ax)*(by-ay) != (bx-ax)*(cy-ay)) kept.push_back(first + k);
+            }
+            first += count;
+        }
+    });
+    out.clear();
+    for (int i = 0; i < chunks; i++)
+    {
+        out.insert(out.end(), chunk_faces[i].begin(), chunk_faces[i].end());
+    }
+}
+
+static bool valid_target(const RenderTarget &target)
+{
+    if (!target.pixels || (target.bytespp != RGB && target.bytespp != RGBA))
+    {
+        cerr << "krender: error: render target must be RGB or RGBA.\n";
+        return false;
+    }
+    return true;
+}
+
+//! Narrows target's clip rectangle to the frame, moving its pointers along. False if nothing is left.
+static bool clip_target(RenderTarget &target, u32 width, u32 height)
+{
+    RenderTarget dst = target;
+    target.x0 = std::max(target.x0, 0);
+    target.y0 = std::max(target.y0, 0);
+    target.x1 = std::min(target.x1, (int) width);
+    target.y1 = std::min(target.y1, (int) height);
+    if (target.x0 >= target.x1 || target.y0 >= target.y1)
+    {
+        return false;
+    }
+    target.pixels += (target.y0-dst.y0)*dst.pitch + (target.x0-dst.x0)*dst.bytespp;
+    if (target.depth)
+    {
+        target.depth += (target.y0-dst.y0)*dst.depth_pitch + (target.x0-dst.x0);
+    }
+    return true;
+}
+
+//! The i-th of bands horizontal slices of target.
+static RenderTarget band_of(const RenderTarget &target, int i, int bands)
+{
+    int rows = target.y1 - target.y0;
+    RenderTarget band = target;
+    band.y0 = target.y0 + rows * i / bands;
+    band.y1 = target.y0 + rows * (i+1) / bands;
+    band.pixels += (band.y0-target.y0)*target.pitch;
+    if (band.depth)
+    {
+        band.depth += (band.y0-target.y0)*target.depth_pitch;
+    }
+    return band;
+}
+
+static void clear_band(RenderTarget &band)
+{
+    size_t row_bytes = (size_t) (band.x1-band.x0)*band.bytespp;
+    for (int y = 0; y < band.y1-band.y0; y++)
+    {
+        memset(band.pixels + y*band.pitch, 0, row_bytes);
+        if (band.depth)
+        {
+            std::fill_n(band.depth + y*band.depth_pitch, band.x1-band.x0, -std::numeric_limits<float>::max());
+        }
+    }
+}
+
+//! Calls fn with view, or with consecutive blocks of it if it is a compact mesh left encoded by
+//! cull(), decoding each into scratch. Blocks come in face order, so painter's order is kept.
+template <typename F>
+static void for_each_block(const CompactMesh *mesh, const MeshView &view, vector<u32> &scratch, F fn)
+{
+    if (view.tris)
+    {
+        fn(view);
+        return;
+    }
+    scratch.resize(3*block_faces);
+    for (size_t first = 0; first < view.ntris; first += block_faces)
+    {
+        MeshView block   = view;
+        block.ntris      = std::min(block_faces, view.ntris - first);
+        block.tris       = scratch.data();
+        block.first_face = first;
+        mesh->face_indices(first, block.ntris, scratch.data());
+        fn(block);
+    }
+}
+
+static void run_pass(RenderMode mode, const MeshView &view, RenderTarget &band, TGAColor wire_color)
+{
+    switch (mode)
+    {
+    case WIREFRAME:     wireframe_pass(view, band, wire_color); break;
+    case GOURAUD:       gouraud_pass(view, band);               break;
+    case GOURAUD_Z:     gouraud_z_pass(view, band);             break;
+    case RANDOM_COLORS: random_colors_pass(view, band);         break;
+    case DEFERRED:      break;
+    }
+}
+
+bool RenderContext::render(RenderMode mode, u32 width, u32 height, const RenderTarget &dst)
+{
+    return render_faces(mode, width, height, dst, NULL);
+}
+
+bool RenderContext::render_faces(RenderMode mode, u32 width, u32 height, const RenderTarget &dst, const vector<u32> *faces)
+{
+    if (!model && !mesh)
+    {
+        cerr << "krender: error: no model loaded.\n";
+        return false;
+    }
+    if (!model && mode == DEFERRED)
+    {
+        cerr << "krender: error: deferred shading needs a full model, not a compact mesh.\n";
+        return false;
+    }
+    if (!valid_target(dst))
+    {
+        return false;
+    }
+    KTRACE(render_mode_name(mode));
+
+    RenderTarget target = dst;
+    bool z_buffered = is_z_buffered(mode);
+    if (!z_buffered)
+    {
+        target.depth = NULL;
+    }
+    if (!clip_target(target, width, height))
+    {
+        return true;
+    }
+
+    bool multisampled = z_buffered && samples > 1 && mode != DEFERRED;
+    SampleTarget st;
+    if (multisampled)
+    {
+        st.samples      = samples;
+        st.pitch        = target.x1 - target.x0;
+        st.plane_stride = (size_t) st.pitch * (target.y1 - target.y0);
+        st.bytespp      = target.bytespp;
+        sample_color.resize(st.plane_stride * samples * st.bytespp);
+        sample_depth.resize(st.plane_stride * samples);
+        st.color = sample_color.data();
+        st.depth = sample_depth.data();
+        st.x0 = target.x0;
+        st.x1 = target.x1;
+        st.y0 = target.y0;
+        st.y1 = target.y1;
+        target.depth = NULL;
+    }
+    else if (z_buffered && !target.depth)
+    {
+        target.depth_pitch = target.x1 - target.x0;
+        zscratch.resize((size_t) target.depth_pitch * (target.y1 - target.y0));
+        target.depth = zscratch.data();
+    }
+
+    transform(width, height);
+    if (multisampled)
+    {
+        st.zmin   = xf_zmin;
+        st.zscale = xf_zmax > xf_zmin ? 65534.f / (xf_zmax - xf_zmin) : 0;
+    }
+
+    MeshView view;
+    cull(target, width, height, faces, view);
+
+    int bands = std::min<int>(pool.size(), target.y1 - target.y0);
+    band_tris.resize(bands);
+    if (z_buffered && !multisampled && raster_stats_enabled())
+    {
+        for_each_block(mesh.get(), view, band_tris[0], [&](const MeshView &block) {
+            count_raster_classes(block, target);
+        });
+    }
+
+    if (mode == DEFERRED)
+    {
+        render_deferred(view, target);
+        return true;
+    }
+
+    // Each worker owns a horizontal band of the target and walks the whole face list,
+    // which keeps the painter's order of the non z-buffered passes intact.
+    pool.parallel_for(bands, [&](int i) {
+        KTRACE("band", i);
+        RenderTarget band = band_of(target, i, bands);
+        vector<u32> &scratch = band_tris[i];
+
+        if (multisampled)
+        {
+            SampleTarget sband = st;
+            sband.y0 = band.y0;
+            sband.y1 = band.y1;
+            sband.color += (size_t) (band.y0-target.y0)*st.pitch*st.bytespp;
+            sband.depth += (size_t) (band.y0-target.y0)*st.pitch;
+            msaa_clear(sband);
+            for_each_block(mesh.get(), view, scratch, [&](const MeshView &block) {
+                if (mode == GOURAUD_Z)
+                    msaa_gouraud_z_pass(block, sband);
+                else
+                    msaa_random_colors_pass(block, sband);
+            });
+            msaa_resolve(sband, band);
+            return;
+        }
+
+        clear_band(band);
+        for_each_block(mesh.get(), view, scratch, [&](const MeshView &block) {
+            run_pass(mode, block, band, wire_color);
+        });
+    });
+    return true;
+}
+
+void RenderContext::render_deferred(const MeshView &view, const RenderTarget &target)
+{
+    VisibilityTarget vis;
+    vis.pitch       = target.x1 - target.x0;
+    idscratch.resize((size_t) vis.pitch * (target.y1 - target.y0));
+    vis.ids         = idscratch.data();
+    vis.depth       = target.depth;
+    vis.depth_pitch = target.depth_pitch;
+    vis.x0 = target.x0;
+    vis.y0 = target.y0;
+    vis.x1 = target.x1;
+    vis.y1 = target.y1;
+
+    // Visibility only, in bands like the forward passes
+    int bands = std::min<int>(pool.size(), target.y1 - target.y0);
+    pool.parallel_for(bands, [&](int i) {
+        KTRACE("visibility band", i);
+        RenderTarget band = band_of(target, i, bands);
+        VisibilityTarget vband = vis;
+        vband.y0     = band.y0;
+        vband.y1     = band.y1;
+        vband.ids   += (band.y0-target.y0)*vis.pitch;
+        vband.depth  = band.depth;
+        clear_band(band);
+        visibility_clear(vband);
+        visibility_pass(view, vband);
+    });
+
+    // Shading cost now follows the covered pixels rather than the faces, so finer slices balance better
+    int slices = std::min<int>(4*pool.size(), target.y1 - target.y0);
+    pool.parallel_for(slices, [&](int i) {
+        KTRACE("shade slice", i);
+        RenderTarget slice = band_of(target, i, slices);
+        deferred_shade(vis, *model, world.data(), screen.data(), camera.theta, texture.get(), slice);
+    });
+}
+
+TGAImage RenderContext::render(RenderMode mode, u32 width, u32 height)
+{
+    TGAImage image(width, height, RGB);
+    render(mode, width, height, image_target(image));
+    return image;
+}
+
+bool RenderContext::render_progressive(RenderMode mode, u32 width, u32 height, const PassCallback &on_pass, int passes)
+{
+    if (!model && !mesh)
+    {
+        cerr << "krender: error: no model loaded.\n";
+        return false;
+    }
+    int final_samples = samples;
+    for (int pass = 0; pass < passes; pass++)
+    {
+        KTRACE("progressive pass", pass);
+        int shift = passes - 1 - pass;
+        u32 w = std::max(1u, width >> shift), h = std::max(1u, height >> shift);
+        bool last = !shift;
+        TGAImage image(w, h, RGB);
+
+        // Faces without area never reach a single-sampled z-buffer, so dropping them is
+        // lossless there. Previews drop them whatever the mode, and skip multisampling.
+        samples = last ? final_samples : 1;
+        bool lossless = is_z_buffered(mode) && samples == 1;
+        bool ok;
+        if (last && !lossless)
+        {
+            ok = render(mode, w, h, image_target(image));
+        }
+        else
+        {
+            transform(w, h);
+            drop_degenerate(mode, pass_faces);
+            ok = render_faces(mode, w, h, image_target(image), &pass_faces);
+        }
+        samples = final_samples;
+        if (!ok)
+        {
+            return false;
+        }
+        on_pass(pass, passes, image);
+    }
+    return true;
+}
+
+bool RenderContext::render_streaming(const char *filename, u32 width, u32 height, const RenderMode *modes, const RenderTarget *dsts, int n)
+{
+    KTRACE("stream");
+    vector<RenderTarget>  targets(dsts, dsts + n);
+    vector<vector<float>> depths(n);
+    int bands = 1;
+    for (int o = 0; o < n; o++)
+    {
+        if (!valid_target(targets[o]))
+        {
+            return false;
+        }
+        if (modes[o] == DEFERRED)
+        {
+            cerr << "krender: error: deferred shading needs a loaded model, it cannot be streamed.\n";
+            return false;
+        }
+        if (!is_z_buffered(modes[o]))
+        {
+            targets[o].depth = NULL;
+        }
+        if (!clip_target(targets[o], width, height))
+        {
+            // Nothing to draw; an empty clip rectangle keeps every pass away from it
+            targets[o].x1 = targets[o].x0;
+            targets[o].y1 = targets[o].y0;
+            continue;
+        }
+        if (is_z_buffered(modes[o]) && !targets[o].depth)
+        {
+            targets[o].depth_pitch = targets[o].x1 - targets[o].x0;
+            depths[o].resize((size_t) targets[o].depth_pitch * (targets[o].y1 - targets[o].y0));
+            targets[o].depth = depths[o].data();
+        }
+        bands = std::max(bands, std::min<int>(pool.size(), targets[o].y1 - targets[o].y0));
+    }
+    pool.parallel_for(bands*n, [&](int k) {
+        RenderTarget band = band_of(targets[k / bands], k % bands, bands);
+        clear_band(band);
+    });
+
+    FaceStream stream(filename);
+    vector<u32>   identity(3*stream.batch_size());
+    vector<Vec3f> bworld(identity.size()), bscreen(identity.size());
+    for (size_t i = 0; i < identity.size(); i++) identity[i] = i;
+
+    // The parser fills the next batches while this thread rasterizes the current one
+    FaceBatch *batch;
+    while (stream.next(batch))
+    {
+        KTRACE("batch", batch->first_face);
+        transform_vertices(batch->verts.data(), 3*batch->nfaces, camera, width, height, bworld.data(), bscreen.data());
+        MeshView view;
+        view.world      = bworld.data();
+        view.screen     = bscreen.data();
+        view.tris       = identity.data();
+        view.ntris      = batch->nfaces;
+        view.first_face = batch->first_face;
+        view.face_ids   = NULL;
+        for (int o = 0; o < n; o++)
+        {
+            if (is_z_buffered(modes[o]) && raster_stats_enabled())
+            {
+                count_raster_classes(view, targets[o]);
+            }
+        }
+        pool.parallel_for(bands*n, [&](int k) {
+            KTRACE("band", k);
+            RenderTarget band = band_of(targets[k / bands], k % bands, bands);
+            run_pass(modes[k / bands], view, band, wire_color);
+        });
+        stream.release(batch);
+    }
+    if (!stream.ok())
+    {
+        return false;
+    }
+    if (stream.skipped())
+    {
+        cerr << "krender: warning: skipped " << stream.skipped() << " faces referring to unknown vertices.\n";
+    }
+    cerr << "krender: streamed model \"" << filename << "\" with " << stream.vertices() << " vertices and " << stream.faces() << " faces.\n";
+    return true;
+}
@@ -0,0 +1,444 @@
+#include "includes/kdist.h"
+#include "includes/kchannel.h"
+#include "includes/kio.h"
+#include "includes/kserver.h"
+#include "includes/ktrace.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::cerr;
+using std::string;
+using std::istringstream;
+using std::vector;
+
+namespace {
+
+const int OUTPUTS = 3;
+
+struct Job {
+    u32 id;         // Order in which jobs were queued
+    u32 frame;
+    int tile[4];    // x0, y0, x1, y1
+};
+
+struct Frame {
+    TGAImage images[OUTPUTS];
+    u32      tiles_left;
+};
+
+//! Jobs not yet handed to a worker. Jobs handed out are still counted as running until
+//! the worker reports back, since a failure puts them back in the queue.
+class JobQueue {
+public:
+    JobQueue() : running(0) { }
+
+    void push(const Job &job)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        jobs.push_back(job);
+        ready.notify_one();
+    }
+
+    //! Blocks while the queue is empty and other jobs may still come back.
+    //! Returns false once everything is done.
+    bool pop(Job &job)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        ready.wait(guard, [&] { return !jobs.empty() || !running; });
+        if (jobs.empty()) return false;
+        job = jobs.front();
+        jobs.pop_front();
+        running++;
+        return true;
+    }
+
+    void done()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        if (!--running) ready.notify_all();
+    }
+
+    //! Puts a job back in front, for the next worker to pick up.
+    void failed(const Job &job)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        jobs.push_front(job);
+        running--;
+        ready.notify_one();
+    }
+
+    size_t left()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        return jobs.size() + running;
+    }
+
+private:
+    std::deque<Job>         jobs;
+    u32                     running;
+    std::mutex              lock;
+    std::condition_variable ready;
+};
+
+struct Worker {
+    string                   name;
+    int                      fd;
+    pid_t                    pid;       // 0 for servers we only connected to
+    std::unique_ptr<Channel> channel;
+    u32                      jobs_done;
+};
+
+//! What the workers share: the job description, and the frames being assembled.
+struct Coordinator {
+    const config_t &cfg;
+    string          model_key;
+    string          model_data;
+    string          modes[OUTPUTS];
+    string          names[OUTPUTS];
+    JobQueue        queue;
+    std::mutex      frames_lock;
+    vector<Frame>   frames;
+    u32             jobs_failed;
+
+    Coordinator(const config_t &c) : cfg(c), jobs_failed(0) { }
+};
+
+enum JobResult {
+    JOB_DONE,
+    JOB_FAILED,         // The worker answered with an error; trying elsewhere won't help
+    WORKER_LOST         // The worker went away or stopped making sense
+};
+
+//! Starts `krender --serve -` on one end of a socket pair.
+bool spawn_worker(Worker &w, u32 threads)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds))
+    {
+        cerr << "krender: couldn't create a socket pair: " << strerror(errno) << "\n";
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        cerr << "krender: couldn't fork: " << strerror(errno) << "\n";
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (!pid)
+    {
+        dup2(fds[1], STDIN_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
+        string j = std::to_string(threads);
+        execl("/proc/self/exe", "krender", "--serve", "-", "-j", j.c_str(), "-c", "2", (char *)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    w.name = "worker " + std::to_string(pid);
+    w.fd   = fds[0];
+    w.pid  = pid;
+    return true;
+}
+
+bool connect_worker(Worker &w, const string &address)
+{
+    w.name = address;
+    w.fd   = channel_connect(address.c_str());
+    w.pid  = 0;
+    return w.fd >= 0;
+}
+
+//! Closes the link to w and stops it if we started it; sig is SIGKILL for one that hung.
+void drop_worker(Worker &w, int sig = SIGTERM)
+{
+    if (w.fd >= 0)
+    {
+        close(w.fd);
+        w.fd = -1;
+    }
+    if (w.pid)
+    {
+        kill(w.pid, sig);
+        waitpid(w.pid, NULL, 0);
+        w.pid = 0;
+    }
+}
+
+JobResult upload_model(Worker &w, Coordinator &co)
+{
+    KTRACE("upload model");
+    string line;
+    string request = "model " + co.model_key + " " + std::to_string(co.model_data.size()) + "\n";
+    if (!w.channel->write(request) || !w.channel->write(co.model_data) || !w.channel->read_line(line))
+        return WORKER_LOST;
+    if (line.compare(0, 3, "ok "))
+    {
+        cerr << "krender: " << w.name << ": " << line << "\n";
+        return JOB_FAILED;
+    }
+    return JOB_DONE;
+}
+
+//! Renders one tile on w, decoding the outputs into tiles.
+JobResult run_job(Worker &w, Coordinator &co, const Job &job, TGAImage tiles[OUTPUTS])
+{
+    KTRACE("job", job.id);
+    const config_t &cfg = co.cfg;
+    float theta = cfg.rotation + 2*M_PI*job.frame/cfg.frames;
+    char args[256];
+    snprintf(args, sizeof(args), " %.9g %u %u msaa=%u view=%.9g,%.9g,%.9g tile=%d,%d,%d,%d",
+             theta, cfg.width, cfg.height, cfg.samples, cfg.center_x, cfg.center_y, cfg.zoom,
+             job.tile[0], job.tile[1], job.tile[2], job.tile[3]);
+    string request = "render " + co.model_key + args;
+    for (int i = 0; i < OUTPUTS; i++)
+    {
+        request += " " + co.modes[i] + "=-";
+    }
+    request += "\n";
+
+    string line;
+    if (!w.channel->write(request) || !w.channel->read_line(line))
+        return WORKER_LOST;
+    if (line == "error unknown model " + co.model_key)
+    {
+        JobResult uploaded = upload_model(w, co);
+        if (uploaded != JOB_DONE)
+            return uploaded;
+        if (!w.channel->write(request) || !w.channel->read_line(line))
+            return WORKER_LOST;
+    }
+    if (line.compare(0, 3, "ok "))
+    {
+        cerr << "krender: " << w.name << ": " << line << "\n";
+        return JOB_FAILED;
+    }
+
+    for (int i = 0; i < OUTPUTS; i++)
+    {
+        string mode, dash, data;
+        size_t bytes;
+        if (!w.channel->read_line(line))
+            return WORKER_LOST;
+        istringstream iss(line);
+        if (!(iss >> mode >> dash >> bytes) || mode != co.modes[i] || dash != "-" || !w.channel->read_bytes(bytes, data))
+            return WORKER_LOST;
+        if (!tiles[i].read_tga_memory((const u8 *)data.data(), data.size()) ||
+            tiles[i].get_width() != job.tile[2]-job.tile[0] || tiles[i].get_height() != job.tile[3]-job.tile[1])
+            return WORKER_LOST;
+    }
+    return JOB_DONE;
+}
+
+string frame_name(const Coordinator &co, int output, u32 frame)
+{
+    if (co.cfg.frames == 1)
+        return co.names[output] + ".tga";
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".%04u.tga", frame);
+    return co.names[output] + suffix;
+}
+
+//! Pastes finished tiles into their frame, saving it if it was the last one.
+void deliver(Coordinator &co, const Job &job, TGAImage tiles[OUTPUTS])
+{
+    KTRACE("deliver", job.id);
+    Frame done;
+    {
+        std::unique_lock<std::mutex> guard(co.frames_lock);
+        Frame &frame = co.frames[job.frame];
+        for (int i = 0; i < OUTPUTS; i++)
+        {
+            TGAImage &image = frame.images[i];
+            if (!image.get_width())
+            {
+                image = TGAImage(co.cfg.width, co.cfg.height, RGB);
+            }
+            // Decoded tiles are top-down, frames bottom-up
+            tiles[i].flip_vertically();
+            size_t row = (job.tile[2]-job.tile[0]) * RGB;
+            for (int y = 0; y < tiles[i].get_height(); y++)
+            {
+                memcpy(image.buffer() + ((job.tile[1]+y)*image.get_width() + job.tile[0]) * RGB,
+                       tiles[i].buffer() + y*row, row);
+            }
+        }
+        if (--frame.tiles_left)
+            return;
+        for (int i = 0; i < OUTPUTS; i++)
+        {
+            done.images[i] = frame.images[i];
+            frame.images[i] = TGAImage();
+        }
+    }
+    for (int i = 0; i < OUTPUTS; i++)
+    {
+        save_result(done.images[i], frame_name(co, i, job.frame).c_str());
+    }
+}
+
+void worker_loop(Worker &w, Coordinator &co)
+{
+    trace_thread_name("worker link");
+    w.channel.reset(new Channel(w.fd, w.fd));
+    TGAImage tiles[OUTPUTS];
+    Job job;
+    while (co.queue.pop(job))
+    {
+        // A worker that hangs would otherwise hold its tile, and the whole run, forever
+        if (co.cfg.job_timeout)
+            w.channel->set_deadline(std::chrono::steady_clock::now() + std::chrono::seconds(co.cfg.job_timeout));
+        JobResult result = run_job(w, co, job, tiles);
+        w.channel->set_deadline(std::chrono::steady_clock::time_point());
+        if (result == WORKER_LOST)
+        {
+            bool hung = w.channel->timed_out();
+            if (hung)
+                cerr << "krender: " << w.name << " took over " << co.cfg.job_timeout << " s on a tile, requeueing it.\n";
+            else
+                cerr << "krender: lost " << w.name << ", requeueing its tile.\n";
+            co.queue.failed(job);
+            drop_worker(w, hung ? SIGKILL : SIGTERM);
+            return;
+        }
+        if (result == JOB_DONE)
+        {
+            deliver(co, job, tiles);
+            w.jobs_done++;
+        }
+        else
+        {
+            std::unique_lock<std::mutex> guard(co.frames_lock);
+            co.jobs_failed++;
+        }
+        co.queue.done();
+    }
+}
+
+bool read_file(const char *filename, string &data)
+{
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.is_open())
+        return false;
+    data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return !in.bad();
+}
+
+}
+
+int run_coordinator(config_t cfg)
+{
+    Coordinator co(cfg);
+    if (!read_file(cfg.obj_file, co.model_data))
+    {
+        cerr << "krender: fatal: couldn't read \"" << cfg.obj_file << "\".\n";
+        return 1;
+    }
+    co.model_key = hash_key(content_hash(co.model_data.data(), co.model_data.size()));
+    const char *modes[OUTPUTS] = { "wireframe", "gouraud", cfg.deferred ? "deferred" : "zbuffer" };
+    const char *names[OUTPUTS] = { "output-wireframe", "output-gouraud-no-z", "output-gourand-with-z" };
+    for (int i = 0; i < OUTPUTS; i++)
+    {
+        co.modes[i] = modes[i];
+        co.names[i] = names[i];
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    vector<Worker> workers;
+    const char *list = cfg.workers;
+    if (strspn(list, "0123456789") == strlen(list))
+    {
+        u32 count = std::max(1, std::atoi(list));
+        u32 hardware = cfg.threads ? cfg.threads : std::max(1u, std::thread::hardware_concurrency());
+        u32 threads = std::max(1u, hardware / count);
+        for (u32 i = 0; i < count; i++)
+        {
+            Worker w = Worker();
+            if (spawn_worker(w, threads))
+                workers.push_back(std::move(w));
+        }
+    }
+    else
+    {
+        istringstream addresses(list);
+        string address;
+        while (std::getline(addresses, address, ','))
+        {
+            Worker w = Worker();
+            if (!address.empty() && connect_worker(w, address))
+                workers.push_back(std::move(w));
+        }
+    }
+    if (workers.empty())
+    {
+        cerr << "krender: fatal: no workers available.\n";
+        return 1;
+    }
+
+    u32 k = std::min(cfg.tiles, std::min(cfg.width, cfg.height));
+    co.frames.resize(cfg.frames);
+    for (u32 f = 0; f < cfg.frames; f++)
+    {
+        co.frames[f].tiles_left = k*k;
+        for (u32 ty = 0; ty < k; ty++)
+            for (u32 tx = 0; tx < k; tx++)
+            {
+                Job job = { (f*k + ty)*k + tx, f, { int(cfg.width*tx/k), int(cfg.height*ty/k), int(cfg.width*(tx+1)/k), int(cfg.height*(ty+1)/k) } };
+                co.queue.push(job);
+            }
+    }
+    cerr << "krender: rendering " << cfg.frames << " frame(s) in " << k*k << " tile(s) each on " << workers.size() << " worker(s).\n";
+
+    auto start = std::chrono::steady_clock::now();
+    vector<std::thread> threads;
+    for (Worker &w : workers)
+    {
+        threads.emplace_back(worker_loop, std::ref(w), std::ref(co));
+    }
+    for (std::thread &t : threads)
+    {
+        t.join();
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    for (Worker &w : workers)
+    {
+        if (w.fd < 0)
+            continue;
+        // Servers we only connected to keep running for other clients
+        string line;
+        if (w.pid && w.channel->write("quit\n"))
+            w.channel->read_line(line);
+        close(w.fd);
+        if (w.pid)
+            waitpid(w.pid, NULL, 0);
+        cerr << "krender: " << w.name << " rendered " << w.jobs_done << " tile(s).\n";
+    }
+
+    size_t left = co.queue.left();
+    if (left || co.jobs_failed)
+    {
+        cerr << "krender: fatal: " << left + co.jobs_failed << " tile(s) could not be rendered.\n";
+        return 1;
+    }
+    cerr << "krender: done in " << ms << " ms.\n";
+    return 0;
+}
@@ -0,0 +1,416 @@
+#include "includes/kimage.h"
+#include "includes/ktrace.h"
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+//! Images smaller than this are not worth waking the pool for
+const size_t PARALLEL_BYTES = 1 << 18;
+
+//! Calls fn(begin, end) over [0, rows) in blocks, on the pool if it has more than one thread.
+void for_row_blocks(ThreadPool *pool, int rows, size_t row_bytes, const std::function<void(int, int)> &fn)
+{
+    int blocks = 1;
+    if (pool && pool->size() > 1 && rows*row_bytes >= PARALLEL_BYTES)
+    {
+        blocks = std::min<int>(4*pool->size(), rows);
+    }
+    if (blocks <= 1)
+    {
+        fn(0, rows);
+        return;
+    }
+    pool->parallel_for(blocks, [&](int i) {
+        fn((s64) rows*i/blocks, (s64) rows*(i + 1)/blocks);
+    });
+}
+
+void swap_bytes(u8 *a, u8 *b, size_t n)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        _mm_storeu_si128((__m128i *)(a + i), y);
+        _mm_storeu_si128((__m128i *)(b + i), x);
+    }
+#endif
+    for (; i + 8 <= n; i += 8)
+    {
+        u64 x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        memcpy(a + i, &y, 8);
+        memcpy(b + i, &x, 8);
+    }
+    for (; i < n; i++)
+    {
+        std::swap(a[i], b[i]);
+    }
+}
+
+template <int BPP>
+void reverse_pixels(u8 *left, u8 *right)
+{
+    u8 pixel[BPP];
+    for (; left < right; left += BPP, right -= BPP)
+    {
+        memcpy(pixel, left,  BPP);
+        memcpy(left,  right, BPP);
+        memcpy(right, pixel, BPP);
+    }
+}
+
+void reverse_row(u8 *row, int width, int bpp)
+{
+    if (width < 2) return;
+    u8 *left = row, *right = row + (size_t) (width - 1)*bpp;
+    switch (bpp)
+    {
+    case 1: reverse_pixels<1>(left, right); return;
+    case 3: reverse_pixels<3>(left, right); return;
+    case 4:
+#ifdef __SSE2__
+        // Four pixels from each end at a time, reversed within the register and swapped
+        for (; right - left >= 7*4; left += 16, right -= 16)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i *) left);
+            __m128i y = _mm_loadu_si128((const __m128i *)(right - 12));
+            _mm_storeu_si128((__m128i *) left,         _mm_shuffle_epi32(y, _MM_SHUFFLE(0, 1, 2, 3)));
+            _mm_storeu_si128((__m128i *)(right - 12), _mm_shuffle_epi32(x, _MM_SHUFFLE(0, 1, 2, 3)));
+        }
+#endif
+        reverse_pixels<4>(left, right);
+        return;
+    default:
+        for (; left < right; left += bpp, right -= bpp)
+        {
+            swap_bytes(left, right, bpp);
+        }
+    }
+}
+
+//! Source pixels covered by each destination pixel of one axis, and how much of it each one covers.
+struct Taps {
+    std::vector<int>   first, count;
+    std::vector<float> weight;  // count[i] entries per destination pixel, summing to 1
+    std::vector<int>   offset;  // Index of the first weight of each destination pixel
+};
+
+//! Destination pixel i spans [i*from, (i+1)*from) and source pixel x spans [x*to, (x+1)*to),
+//! both in units of 1/to of a source pixel, so every overlap is an exact integer.
+Taps make_taps(int from, int to)
+{
+    Taps taps;
+    taps.first.resize(to);
+    taps.count.resize(to);
+    taps.offset.resize(to);
+    for (int i = 0; i < to; i++)
+    {
+        s64 lo = (s64) i*from, hi = lo + from;
+        int x0 = lo/to, x1 = (hi + to - 1)/to;
+        taps.first[i]  = x0;
+        taps.count[i]  = x1 - x0;
+        taps.offset[i] = taps.weight.size();
+        for (int x = x0; x < x1; x++)
+        {
+            s64 overlap = std::min<s64>(hi, (s64) (x + 1)*to) - std::max<s64>(lo, (s64) x*to);
+            taps.weight.push_back((float) overlap/from);
+        }
+    }
+    return taps;
+}
+
+//! Filters one source row horizontally into out, bpp floats per destination pixel. A
+//! non-zero BPP fixes bpp at compile time, so the channel loops unroll.
+template <int BPP>
+void filter_row(const u8 *src, const Taps &columns, int w, int bpp, float *out)
+{
+    const int n = BPP ? BPP : bpp;
+#ifdef __SSE2__
+    if (BPP == 3 || BPP == 4)
+    {
+        // All channels of a pixel in one register, each lane doing the scalar loop's operations in its order
+        const __m128i zero = _mm_setzero_si128();
+        for (int i = 0; i < w; i++, out += n)
+        {
+            const float *wt = &columns.weight[columns.offset[i]];
+            const u8    *p  = src + (size_t) columns.first[i]*n;
+            __m128 sum = _mm_setzero_ps();
+            for (int t = 0; t < columns.count[i]; t++, p += n)
+            {
+                int pixel = 0;
+                memcpy(&pixel, p, n);
+                __m128i c = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero), zero);
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(wt[t]), _mm_cvtepi32_ps(c)));
+            }
+            float channels[4];
+            _mm_storeu_ps(channels, sum);
+            memcpy(out, channels, n*sizeof(float));
+        }
+        return;
+    }
+#endif
+    for (int i = 0; i < w; i++, out += n)
+    {
+        const float *wt = &columns.weight[columns.offset[i]];
+        const u8    *p  = src + (size_t) columns.first[i]*n;
+        float sum[4] = { 0, 0, 0, 0 };
+        for (int t = 0; t < columns.count[i]; t++, p += n)
+        {
+            for (int c = 0; c < n; c++) sum[c] += wt[t]*p[c];
+        }
+        for (int c = 0; c < n; c++) out[c] = sum[c];
+    }
+}
+
+//! acc[i] += w*row[i]
+void add_weighted(float *acc, const float *row, float w, size_t n)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128 wv = _mm_set1_ps(w);
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), _mm_mul_ps(wv, _mm_loadu_ps(row + i))));
+    }
+#endif
+    for (; i < n; i++) acc[i] += w*row[i];
+}
+
+//! Rounds non-negative sums to the nearest byte, clamped at 255
+void round_row(const float *acc, u8 *dst, size_t n)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128 half = _mm_set1_ps(.5f), top = _mm_set1_ps(255.f);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v[4];
+        for (int k = 0; k < 4; k++)
+        {
+            v[k] = _mm_cvttps_epi32(_mm_min_ps(_mm_add_ps(_mm_loadu_ps(acc + i + 4*k), half), top));
+        }
+        __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3]));
+        _mm_storeu_si128((__m128i *)(dst + i), bytes);
+    }
+#endif
+    for (; i < n; i++) dst[i] = (u8) std::min(255.f, acc[i] + .5f);
+}
+
+//! Converts as many leading pixels of a row as it can with SSE2 and returns how many. Only
+//! layouts that need no byte shuffles within a pixel are done; SSE2 has none to offer.
+template <int SRC, int DST>
+int convert_simd(const u8 *src, u8 *dst, int width)
+{
+    (void) src; (void) dst; (void) width;
+    return 0;
+}
+
+#ifdef __SSE2__
+template <>
+int convert_simd<RGBA, GRAYSCALE>(const u8 *src, u8 *dst, int width)
+{
+    // The scalar luma, in 32-bit lanes: each madd gives b*29 + g*150 and r*77 of two pixels
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weights = _mm_setr_epi16(29, 150, 77, 0, 29, 150, 77, 0);
+    const __m128i round = _mm_set1_epi32(128);
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        // All 64 source bytes are loaded before the 16 gray ones are stored, which keeps in-place rows safe
+        __m128i luma[4];
+        for (int k = 0; k < 4; k++)
+        {
+            __m128i px = _mm_loadu_si128((const __m128i *)(src + 4*(x + 4*k)));
+            __m128  lo = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(px, zero), weights));
+            __m128  hi = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(px, zero), weights));
+            __m128i bg = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+            __m128i r  = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+            luma[k] = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(bg, r), round), 8);
+        }
+        __m128i gray = _mm_packus_epi16(_mm_packs_epi32(luma[0], luma[1]), _mm_packs_epi32(luma[2], luma[3]));
+        _mm_storeu_si128((__m128i *)(dst + x), gray);
+    }
+    return x;
+}
+
+template <>
+int convert_simd<GRAYSCALE, RGBA>(const u8 *src, u8 *dst, int width)
+{
+    const __m128i opaque = _mm_set1_epi8((char) 255);
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i g  = _mm_loadu_si128((const __m128i *)(src + x));
+        __m128i gg = _mm_unpacklo_epi8(g, g), ga = _mm_unpacklo_epi8(g, opaque);
+        _mm_storeu_si128((__m128i *)(dst + 4*x),      _mm_unpacklo_epi16(gg, ga));
+        _mm_storeu_si128((__m128i *)(dst + 4*x + 16), _mm_unpackhi_epi16(gg, ga));
+        gg = _mm_unpackhi_epi8(g, g);
+        ga = _mm_unpackhi_epi8(g, opaque);
+        _mm_storeu_si128((__m128i *)(dst + 4*x + 32), _mm_unpacklo_epi16(gg, ga));
+        _mm_storeu_si128((__m128i *)(dst + 4*x + 48), _mm_unpackhi_epi16(gg, ga));
+    }
+    return x;
+}
+#endif
+
+//! Safe with dst == src when DST <= SRC: every pixel is read before anything at or after it is written.
+template <int SRC, int DST>
+void convert_row(const u8 *src, u8 *dst, int width)
+{
+    int done = convert_simd<SRC, DST>(src, dst, width);
+    src += done*SRC;
+    dst += done*DST;
+    for (int x = done; x < width; x++, src += SRC, dst += DST)
+    {
+        if (DST == GRAYSCALE)
+        {
+            // BT.601 luma in 8.8 fixed point; the weights sum to 256. Memory order is BGR(A).
+            dst[0] = SRC == GRAYSCALE ? src[0] : (29*src[0] + 150*src[1] + 77*src[2] + 128) >> 8;
+            continue;
+        }
+        dst[0] = src[0];
+        dst[1] = src[SRC == GRAYSCALE ? 0 : 1];
+        dst[2] = src[SRC == GRAYSCALE ? 0 : 2];
+        if (DST == RGBA)
+        {
+            dst[3] = SRC == RGBA ? src[3] : 255;
+        }
+    }
+}
+
+typedef void (*ConvertRow)(const u8 *, u8 *, int);
+
+ConvertRow converter(int from, int to)
+{
+    switch (from*8 + to)
+    {
+    case GRAYSCALE*8 + RGB:  return convert_row<GRAYSCALE, RGB>;
+    case GRAYSCALE*8 + RGBA: return convert_row<GRAYSCALE, RGBA>;
+    case RGB*8 + GRAYSCALE:  return convert_row<RGB, GRAYSCALE>;
+    case RGB*8 + RGBA:       return convert_row<RGB, RGBA>;
+    case RGBA*8 + GRAYSCALE: return convert_row<RGBA, GRAYSCALE>;
+    case RGBA*8 + RGB:       return convert_row<RGBA, RGB>;
+    default:                 return NULL;
+    }
+}
+
+}
+
+bool image_flip_vertically(TGAImage &img, ThreadPool *pool)
+{
+    u8 *data = img.buffer();
+    if (!data) return false;
+    KTRACE("flip vertically");
+    const int    height = img.get_height();
+    const size_t row    = (size_t) img.get_width()*img.get_bytespp();
+    for_row_blocks(pool, height/2, 2*row, [&](int begin, int end) {
+        for (int j = begin; j < end; j++)
+        {
+            swap_bytes(data + j*row, data + (height - 1 - j)*row, row);
+        }
+    });
+    return true;
+}
+
+bool image_flip_horizontally(TGAImage &img, ThreadPool *pool)
+{
+    u8 *data = img.buffer();
+    if (!data) return false;
+    KTRACE("flip horizontally");
+    const int    width = img.get_width(), bpp = img.get_bytespp();
+    const size_t row   = (size_t) width*bpp;
+    for_row_blocks(pool, img.get_height(), row, [&](int begin, int end) {
+        for (int j = begin; j < end; j++)
+        {
+            reverse_row(data + j*row, width, bpp);
+        }
+    });
+    return true;
+}
+
+bool image_scale(TGAImage &img, int w, int h, ThreadPool *pool)
+{
+    const u8 *data = img.buffer();
+    if (w <= 0 || h <= 0 || !data) return false;
+    KTRACE("scale");
+    const int width = img.get_width(), height = img.get_height(), bpp = img.get_bytespp();
+    if (bpp > 4) return false;
+    const Taps columns = make_taps(width, w), rows = make_taps(height, h);
+    const size_t src_row = (size_t) width*bpp, dst_row = (size_t) w*bpp;
+    u8 *scaled = new u8[h*dst_row];
+
+    for_row_blocks(pool, h, dst_row + rows.count[0]*src_row, [&](int begin, int end) {
+        std::vector<float> acc(dst_row), filtered(dst_row);
+        for (int j = begin; j < end; j++)
+        {
+            std::fill(acc.begin(), acc.end(), 0.f);
+            for (int k = 0; k < rows.count[j]; k++)
+            {
+                // Each source row is filtered horizontally, then added in with its vertical weight
+                const u8 *src = data + (rows.first[j] + k)*src_row;
+                switch (bpp)
+                {
+                case 1:  filter_row<1>(src, columns, w, bpp, &filtered[0]); break;
+                case 3:  filter_row<3>(src, columns, w, bpp, &filtered[0]); break;
+                case 4:  filter_row<4>(src, columns, w, bpp, &filtered[0]); break;
+                default: filter_row<0>(src, columns, w, bpp, &filtered[0]);
+                }
+                const float wy = rows.weight[rows.offset[j] + k];
+                add_weighted(&acc[0], &filtered[0], wy, dst_row);
+            }
+            round_row(&acc[0], scaled + j*dst_row, dst_row);
+        }
+    });
+    img.adopt(scaled, w, h, bpp);
+    return true;
+}
+
+bool image_convert(TGAImage &img, ColorMode mode, ThreadPool *pool)
+{
+    const u8 *data = img.buffer();
+    if (!data) return false;
+    const int bpp = img.get_bytespp();
+    if (bpp == mode) return true;
+    ConvertRow convert = converter(bpp, mode);
+    if (!convert) return false;
+    KTRACE("convert");
+    const int    width = img.get_width(), height = img.get_height();
+    const size_t src_row = (size_t) width*bpp, dst_row = (size_t) width*mode;
+    if (dst_row < src_row)
+    {
+        // In place: every row is converted where it is, then the rows are packed down in order.
+        // Packing can't be done by the parallel pass, since a row's new place overlaps earlier rows.
+        u8 *pixels = img.buffer();
+        for_row_blocks(pool, height, src_row, [&](int begin, int end) {
+            for (int j = begin; j < end; j++)
+            {
+                convert(pixels + j*src_row, pixels + j*src_row, width);
+            }
+        });
+        for (int j = 1; j < height; j++)
+        {
+            memmove(pixels + j*dst_row, pixels + j*src_row, dst_row);
+        }
+        img.adopt(pixels, width, height, mode);
+        return true;
+    }
+    u8 *converted = new u8[height*dst_row];
+    for_row_blocks(pool, height, src_row + dst_row, [&](int begin, int end) {
+        for (int j = begin; j < end; j++)
+        {
+            convert(data + j*src_row, converted + j*dst_row, width);
+        }
+    });
+    img.adopt(converted, width, height, mode);
+    return true;
+}
@@ -1,6 +1,11 @@
 #include "includes/kio.h"
+#include "includes/ktrace.h"
+#include "includes/kvideo.h"
 #include <string.h>
+#include <stdio.h>
 #include <fstream>
+#include <algorithm>
+#include <string>
 
 using std::cout;
 using std::cerr;
@@ -11,13 +16,24 @@ using std::ofstream;
 config_t parse_cli_input(int argc, char ** argv)
 {
     config_t cfg;
+    memset((void *)&cfg, 0, sizeof(cfg));
+    cfg.cache_size = 8;
+    cfg.samples    = 1;
+    cfg.zoom       = 1;
+    cfg.fps        = 30;
+    cfg.job_timeout = 300;
     if (argc == 1)
     {
-        cerr << "Usage: ./krender [-w, --width <width>] [-r, --rotate <theta>] [-h, --height <height>] -o, --obj <obj-file>\n";
+        cerr << "Usage: ./krender [-w, --width <width>] [-r, --rotate <theta>] [-h, --height <height>] [-j, --threads <n>] [-m, --msaa <samples>] [-d, --deferred] [-t, --texture <tga>] [-p, --progressive] [--compact] [--stream] [--stats] [--watch]\n";
+        cerr << "                 [-z, --zoom <factor>] [--center <x>,<y>] [--crop <x0>,<y0>,<x1>,<y1>] [--trace <json>]\n";
+        cerr << "                 [--partitions <n>] [--partition <k/n>] [--depth-out <pfm>] [--merge <tga>,<pfm>[,...]] -o, --obj <obj-file>\n";
+        cerr << "       ./krender -s, --serve <socket|host:port|-> [-c, --cache <models>] [-j, --threads <n>] [--allow-remote]\n";
+        cerr << "       ./krender --video <file|-> [--video-format <y4m|rgb>] [--fps <n>] [--frames <n>] [render options] -o, --obj <obj-file>\n";
+        cerr << "       ./krender --workers <n|address,...> [--frames <n>] [--tiles <k>] [--job-timeout <s>] [render options] -o, --obj <obj-file>\n";
         cerr << "Use options '-H' or '--help' for help.\n";
         exit(0);
     }
-    bool width_set = false, height_set = false, obj_set;
+    bool width_set = false, height_set = false, obj_set = false;
     for (u8 i = 1; i < argc; i++)
     {
         if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--rotate"))
@@ -36,6 +52,33 @@ config_t parse_cli_input(int argc, char ** argv)
             printf("%-20s\tSets the output TGA's width.  Optional.\n", "-w, --width <arg>");
             printf("%-20s\tSets the output TGA's height. Optional.\n", "-h, --height <arg>");
             printf("%-20s\tSets the .OBJ file to be loaded.\n","-o, --o <obj>");
+            printf("%-20s\tMultisamples z-buffered renders with 2, 4 or 8 samples per pixel.\n", "-m, --msaa <arg>");
+            printf("%-20s\tShades the z-buffered output once per pixel through a visibility buffer, using vertex normals.\n", "-d, --deferred");
+            printf("%-20s\tTextures the deferred output with this TGA, using the model's vt coordinates. Implies -d.\n", "-t, --texture <tga>");
+            printf("%-20s\tRenders each output at 1/8, 1/4 and 1/2 scale first, saving every pass.\n", "-p, --progressive");
+            printf("%-20s\tZooms in by this factor around the view center. Default: 1.\n", "-z, --zoom <arg>");
+            printf("%-20s\tView center, in model units. Default: 0,0.\n", "--center <x>,<y>");
+            printf("%-20s\tOnly renders this rectangle of the frame, in pixels.\n", "--crop <x0>,<y0>,<x1>,<y1>");
+            printf("%-20s\tRenders faces as they are parsed, without keeping them in memory.\n", "--stream");
+            printf("%-20s\tKeeps the model with 16-bit positions and mostly 16-bit indices, reporting the error in pixels.\n", "--compact");
+            printf("%-20s\tKeeps running, redrawing the parts of the outputs that change whenever the .OBJ file is saved.\n", "--watch");
+            printf("%-20s\tPrints how many triangles were sub-pixel, tiny or larger once rendering is done.\n", "--stats");
+            printf("%-20s\tNumber of render threads. Default: one per core.\n", "-j, --threads <arg>");
+            printf("%-20s\tServes render requests on a Unix socket, a TCP host:port, or on stdin/stdout if '-'.\n", "-s, --serve <arg>");
+            printf("%-20s\tNumber of parsed models kept by the server. Default: 8.\n", "-c, --cache <arg>");
+            printf("%-20s\tLets --serve listen on TCP addresses other than loopback.\n", "--allow-remote");
+            printf("%-20s\tSplits the work over this many local servers, or over the listed server addresses.\n", "--workers <arg>");
+            printf("%-20s\tWrites the z-buffered frames to this file, or to stdout if '-', as a video.\n", "--video <arg>");
+            printf("%-20s\tVideo format: y4m (YUV4MPEG2 4:2:0) or rgb (raw RGB24). Default: y4m.\n", "--video-format <arg>");
+            printf("%-20s\tFrame rate written to the video header. Default: 30.\n", "--fps <arg>");
+            printf("%-20s\tWith --workers or --video, renders this many frames of a full turn. Default: 1.\n", "--frames <arg>");
+            printf("%-20s\tWith --workers, splits every frame into k x k tiles. Default: 4 for one frame, else 1.\n", "--tiles <k>");
+            printf("%-20s\tWith --workers, drops a worker that takes longer than this on a tile. 0: no limit. Default: 300.\n", "--job-timeout <s>");
+            printf("%-20s\tRenders the z-buffered output as n spatial partitions and composites them by depth.\n", "--partitions <n>");
+            printf("%-20s\tRenders only partition k of the n above into the z-buffered output, to be merged later.\n", "--partition <k/n>");
+            printf("%-20s\tSaves the depth of the z-buffered output as a PFM image.\n", "--depth-out <pfm>");
+            printf("%-20s\tComposites previously saved layers into the z-buffered output by depth.\n", "--merge <tga>,<pfm>");
+            printf("%-20s\tRecords a timeline of every thread and writes it here at exit, in Chrome trace format.\n", "--trace <json>");
             printf("%-20s\tShows this message and exits.\n",        "-H, --help");
         }
         else if (!strcmp(argv[i], "-w") || !strcmp(argv[i], "--width"))
@@ -68,11 +111,253 @@ config_t parse_cli_input(int argc, char ** argv)
             cfg.obj_file = argv[++i];
             obj_set = true;
         }
+        else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--serve"))
+        {
+            if (i + 1 >= argc)
+            {
+                cerr << "krender: missing value to --serve";
+                exit(0);
+            }
+            cfg.server_mode = true;
+            cfg.socket_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--allow-remote"))
+        {
+            cfg.allow_remote = true;
+        }
+        else if (!strcmp(argv[i], "-m") || !strcmp(argv[i], "--msaa"))
+        {
+            if (i + 1 >= argc)
+            {
+                cerr << "krender: missing value to --msaa";
+                exit(0);
+            }
+            cfg.samples = std::atoi(argv[++i]);
+            if (cfg.samples != 1 && cfg.samples != 2 && cfg.samples != 4 && cfg.samples != 8)
+            {
+                cerr << "krender: fatal: --msaa expects 1, 2, 4 or 8.\n";
+                exit(0);
+            }
+        }
+        else if (!strcmp(argv[i], "-z") || !strcmp(argv[i], "--zoom"))
+        {
+            if (i + 1 >= argc)
+            {
+                cerr << "krender: missing value to --zoom";
+                exit(0);
+            }
+            cfg.zoom = std::stof(argv[++i]);
+            if (!(cfg.zoom > 0))
+            {
+                cerr << "krender: fatal: --zoom must be positive.\n";
+                exit(0);
+            }
+        }
+        else if (!strcmp(argv[i], "--center"))
+        {
+            if (i + 1 >= argc || sscanf(argv[i+1], "%f,%f", &cfg.center_x, &cfg.center_y) != 2)
+            {
+                cerr << "krender: --center expects <x>,<y>\n";
+                exit(0);
+            }
+            i++;
+        }
+        else if (!strcmp(argv[i], "--crop"))
+        {
+            if (i + 1 >= argc || sscanf(argv[i+1], "%u,%u,%u,%u", &cfg.crop[0], &cfg.crop[1], &cfg.crop[2], &cfg.crop[3]) != 4)
+            {
+                cerr << "krender: --crop expects <x0>,<y0>,<x1>,<y1>\n";
+                exit(0);
+            }
+            cfg.crop_set = true;
+            i++;
+        }
+        else if (!strcmp(argv[i], "--stream"))
+        {
+            cfg.streaming = true;
+        }
+        else if (!strcmp(argv[i], "--compact"))
+        {
+            cfg.compact = true;
+        }
+        else if (!strcmp(argv[i], "--watch"))
+        {
+            cfg.watch = true;
+        }
+        else if (!strcmp(argv[i], "--stats"))
+        {
+            cfg.stats = true;
+        }
+        else if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "--progressive"))
+        {
+            cfg.progressive = true;
+        }
+        else if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--deferred"))
+        {
+            cfg.deferred = true;
+        }
+        else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--texture"))
+        {
+            if (i + 1 >= argc)
+            {
+                cerr << "krender: missing value to --texture";
+                exit(0);
+            }
+            cfg.texture_file = argv[++i];
+            cfg.deferred = true;
+        }
+        else if (!strcmp(argv[i], "--workers"))
+        {
+            if (i + 1 >= argc)
+            {
+                cerr << "krender: missing value to --workers";
+                exit(0);
+            }
+            cfg.workers = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--video"))
+        {
+            if (i + 1 >= argc)
+            {
+                cerr << "krender: missing value to --video";
+                exit(0);
+            }
+            cfg.video_file = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--trace"))
+        {
+            if (i + 1 >= argc)
+            {
+                cerr << "krender: missing value to --trace";
+                exit(0);
+            }
+            cfg.trace_file = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--partitions"))
+        {
+            if (i + 1 >= argc)
+            {
+                cerr << "krender: missing value to --partitions";
+                exit(0);
+            }
+            if (cfg.partition_set)
+            {
+                cerr << "krender: fatal: --partitions and --partition cannot be combined.\n";
+                exit(0);
+            }
+            cfg.partitions = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--partition"))
+        {
+            int k, n;
+            if (i + 1 >= argc || sscanf(argv[i+1], "%d/%d", &k, &n) != 2 || k < 0 || k >= n)
+            {
+                cerr << "krender: --partition expects <k>/<n> with 0 <= k < n\n";
+                exit(0);
+            }
+            if (cfg.partitions)
+            {
+                cerr << "krender: fatal: --partitions and --partition cannot be combined.\n";
+                exit(0);
+            }
+            cfg.partition     = k;
+            cfg.partitions    = n;
+            cfg.partition_set = true;
+            i++;
+        }
+        else if (!strcmp(argv[i], "--depth-out"))
+        {
+            if (i + 1 >= argc)
+            {
+                cerr << "krender: missing value to --depth-out";
+                exit(0);
+            }
+            cfg.depth_file = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--merge"))
+        {
+            if (i + 1 >= argc || std::count(argv[i+1], argv[i+1] + strlen(argv[i+1]), ',') % 2 != 1)
+            {
+                cerr << "krender: --merge expects <tga>,<pfm>[,<tga>,<pfm>...]\n";
+                exit(0);
+            }
+            cfg.merge_layers = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--video-format"))
+        {
+            VideoFormat format;
+            if (i + 1 >= argc || !parse_video_format(argv[i+1], format))
+            {
+                cerr << "krender: --video-format expects y4m or rgb\n";
+                exit(0);
+            }
+            cfg.video_format = format;
+            i++;
+        }
+        else if (!strcmp(argv[i], "--fps"))
+        {
+            if (i + 1 >= argc)
+            {
+                cerr << "krender: missing value to --fps";
+                exit(0);
+            }
+            cfg.fps = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--frames"))
+        {
+            if (i + 1 >= argc)
+            {
+                cerr << "krender: missing value to --frames";
+                exit(0);
+            }
+            cfg.frames = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--tiles"))
+        {
+            if (i + 1 >= argc)
+            {
+                cerr << "krender: missing value to --tiles";
+                exit(0);
+            }
+            cfg.tiles = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--job-timeout"))
+        {
+            if (i + 1 >= argc)
+            {
+                cerr << "krender: missing value to --job-timeout";
+                exit(0);
+            }
+            cfg.job_timeout = std::max(0, std::atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--threads"))
+        {
+            if (i + 1 >= argc)
+            {
+                cerr << "krender: missing value to --threads";
+                exit(0);
+            }
+            cfg.threads = std::max(0, std::atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--cache"))
+        {
+            if (i + 1 >= argc)
+            {
+                cerr << "krender: missing value to --cache";
+                exit(0);
+            }
+            cfg.cache_size = std::max(1, std::atoi(argv[++i]));
+        }
         else {
             cerr << "krender: unknown option \"" << argv[i] << "\".\n";
         }
     }
 
+    if (cfg.server_mode)
+    {
+        return cfg;
+    }
+
     if (!obj_set)
     {
         cerr << "krender: fatal: no Waveform .obj file supplied. Exiting.\n";
@@ -96,23 +381,71 @@ config_t parse_cli_input(int argc, char ** argv)
         cerr << "krender: height and width not set. Assuming 3200 x 3200.\n";
         cfg.height = cfg.width = 3200;
     }
+
+    if (cfg.crop_set && (cfg.crop[0] >= cfg.crop[2] || cfg.crop[1] >= cfg.crop[3] || cfg.crop[2] > cfg.width || cfg.crop[3] > cfg.height))
+    {
+        cerr << "krender: fatal: crop rectangle must lie within the " << cfg.width << " x " << cfg.height << " frame.\n";
+        exit(0);
+    }
+
+    if (cfg.progressive && (cfg.streaming || cfg.crop_set))
+    {
+        cerr << "krender: fatal: --progressive cannot be combined with --stream or --crop.\n";
+        exit(0);
+    }
+
+    if (cfg.workers && (cfg.streaming || cfg.progressive || cfg.crop_set || cfg.texture_file))
+    {
+        cerr << "krender: fatal: --workers cannot be combined with --stream, --progressive, --crop or --texture.\n";
+        exit(0);
+    }
+    if (cfg.video_file && (cfg.workers || cfg.streaming || cfg.progressive))
+    {
+        cerr << "krender: fatal: --video cannot be combined with --workers, --stream or --progressive.\n";
+        exit(0);
+    }
+    if (cfg.watch && (cfg.streaming || cfg.progressive || cfg.crop_set || cfg.workers || cfg.video_file || cfg.compact))
+    {
+        cerr << "krender: fatal: --watch cannot be combined with --stream, --progressive, --crop, --workers, --video or --compact.\n";
+        exit(0);
+    }
+    bool layered = cfg.partitions > 1 || cfg.partition_set || cfg.depth_file || cfg.merge_layers;
+    if (layered && (cfg.samples > 1 || cfg.streaming || cfg.progressive || cfg.compact || cfg.workers || cfg.video_file || cfg.watch))
+    {
+        cerr << "krender: fatal: --partitions, --partition, --depth-out and --merge cannot be combined with -m, --stream, --progressive, --compact, --workers, --video or --watch.\n";
+        exit(0);
+    }
+    if (!cfg.frames)
+    {
+        cfg.frames = 1;
+    }
+    if (!cfg.tiles)
+    {
+        cfg.tiles = cfg.frames == 1 ? 4 : 1;
+    }
+
+    if (cfg.compact && (cfg.deferred || cfg.streaming || cfg.workers))
+    {
+        cerr << "krender: fatal: --compact cannot be combined with --deferred, --texture, --stream or --workers.\n";
+        exit(0);
+    }
+
+    if (cfg.deferred && cfg.streaming)
+    {
+        cerr << "krender: fatal: --deferred needs the whole model and cannot be combined with --stream.\n";
+        exit(0);
+    }
     return cfg;
 }
 
 //! Heavily based off of Dmitry V. Sokolov's TGA saving code.
 //! See LICENSE.md or ktypes.h/.cpp for Dmitry's copyright notice.
-bool save_result(TGAImage img, const char *filename, bool rle) {
+//! Note: flips img in place, since TGAs are stored top-down.
+bool write_tga(TGAImage &img, std::ostream &out, bool rle, ThreadPool *pool) {
     u8 developer_area_ref[4] = {0, 0, 0, 0};
     u8 extension_area_ref[4] = {0, 0, 0, 0};
     u8 footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
-    ofstream out;
-    img.flip_vertically();
-    out.open (filename, std::ios::binary);
-    if (!out.is_open()) {
-        std::cerr << "can't open file " << filename << "\n";
-        out.close();
-        return false;
-    }
+    img.flip_vertically(pool);
     TGA_Header header;
     memset((void *)&header, 0, sizeof(header));
     header.bitsperpixel = img.get_bytespp() <<3;
@@ -122,7 +455,6 @@ bool save_result(TGAImage img, const char *filename, bool rle) {
     header.imagedescriptor = 0x20;
     out.write((char *)&header, sizeof(header));
     if (!out.good()) {
-        out.close();
         std::cerr << "krender: error: could't dump TGA file.\n";
         return false;
     }
@@ -130,31 +462,34 @@ bool save_result(TGAImage img, const char *filename, bool rle) {
         out.write((char *) img.buffer(), img.get_width()*img.get_height()*img.get_bytespp());
         if (!out.good()) {
             std::cerr << "krender: error: could't unload RAW data.\n";
-            out.close();
             return false;
         }
     } else {
         if (!img.unload_rle_data(out)) {
-            out.close();
             std::cerr << "krender: error: could't unload RLE data.\n";
             return false;
         }
     }
     out.write((char *)developer_area_ref, sizeof(developer_area_ref));
+    out.write((char *)extension_area_ref, sizeof(extension_area_ref));
+    out.write((char *)footer, sizeof(footer));
     if (!out.good()) {
         std::cerr << "krender: error: could't dump TGA file.\n";
-        out.close();
         return false;
     }
-    out.write((char *)extension_area_ref, sizeof(extension_area_ref));
-    if (!out.good()) {
-        std::cerr << "krender: error: could't dump TGA file.\n";
+    return true;
+}
+
+bool save_result(TGAImage img, const char *filename, bool rle, ThreadPool *pool) {
+    KTRACE("save tga");
+    ofstream out;
+    out.open (filename, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << filename << "\n";
         out.close();
         return false;
     }
-    out.write((char *)footer, sizeof(footer));
-    if (!out.good()) {
-        std::cerr << "krender: error: could't dump TGA file.\n";
+    if (!write_tga(img, out, rle, pool)) {
         out.close();
         return false;
     }
@@ -162,3 +497,53 @@ bool save_result(TGAImage img, const char *filename, bool rle) {
     cout << "krender: successfully saved \"" << filename << "\".\n";
     return true;
 }
+
+static bool little_endian() {
+    u32 one = 1;
+    u8  first;
+    memcpy(&first, &one, 1);
+    return first == 1;
+}
+
+bool save_depth(const float *depth, int width, int height, const char *filename) {
+    KTRACE("save pfm");
+    ofstream out(filename, std::ios::binary);
+    if (!out.is_open()) {
+        cerr << "krender: error: couldn't open \"" << filename << "\".\n";
+        return false;
+    }
+    // Floats are written as the host holds them; the sign of the scale says which byte order that is
+    out << "Pf\n" << width << " " << height << (little_endian() ? "\n-1.0\n" : "\n1.0\n");
+    out.write((const char *) depth, (size_t) width*height*sizeof(float));
+    out.close();
+    if (!out.good()) {
+        cerr << "krender: error: couldn't write \"" << filename << "\".\n";
+        return false;
+    }
+    cout << "krender: successfully saved \"" << filename << "\".\n";
+    return true;
+}
+
+bool load_depth(const char *filename, std::vector<float> &depth, int &width, int &height) {
+    std::ifstream in(filename, std::ios::binary);
+    std::string magic;
+    float scale;
+    if (!(in >> magic >> width >> height >> scale) || magic != "Pf" || width <= 0 || height <= 0 || in.get() != '\n') {
+        cerr << "krender: error: \"" << filename << "\" is not a grayscale PFM file.\n";
+        return false;
+    }
+    depth.resize((size_t) width*height);
+    if (!in.read((char *) depth.data(), depth.size()*sizeof(float))) {
+        cerr << "krender: error: \"" << filename << "\" ends before its " << width << " x " << height << " pixels.\n";
+        return false;
+    }
+    // A negative scale means little-endian floats, a positive one big-endian
+    if ((scale < 0) != little_endian()) {
+        for (float &d : depth) {
+            u8 *b = (u8 *) &d;
+            std::swap(b[0], b[3]);
+            std::swap(b[1], b[2]);
+        }
+    }
+    return true;
+}
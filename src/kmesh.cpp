@@ -0,0 +1,132 @@
+#include "includes/kmesh.h"
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+CompactMesh::CompactMesh(const Model &model) : faces(model.nfaces())
+{
+    size_t n = model.verts.size();
+    Vec3f hi;
+    for (int a = 0; a < 3; a++)
+    {
+        lo.raw[a] =  std::numeric_limits<float>::max();
+        hi.raw[a] = -std::numeric_limits<float>::max();
+    }
+    for (const Vec3f &v : model.verts)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            lo.raw[a] = std::min(lo.raw[a], v.raw[a]);
+            hi.raw[a] = std::max(hi.raw[a], v.raw[a]);
+        }
+    }
+    for (int a = 0; a < 3; a++)
+    {
+        step.raw[a] = n && hi.raw[a] > lo.raw[a] ? (hi.raw[a] - lo.raw[a]) / 65535 : 0;
+    }
+
+    // The error is measured on the decoded values rather than assumed to be half a step
+    pos.resize(3*n);
+    for (size_t i = 0; i < n; i++)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            float v = model.verts[i].raw[a];
+            long  q = step.raw[a] ? std::lround((v - lo.raw[a]) / step.raw[a]) : 0;
+            pos[3*i+a] = std::min(65535L, std::max(0L, q));
+        }
+    }
+    vector<Vec3f> decoded(std::min<size_t>(n, 4096));
+    for (size_t first = 0; first < n; first += decoded.size())
+    {
+        size_t count = std::min(decoded.size(), n - first);
+        positions(first, count, decoded.data());
+        for (size_t i = 0; i < count; i++)
+        {
+            for (int a = 0; a < 3; a++)
+            {
+                error.raw[a] = std::max(error.raw[a], std::fabs(decoded[i].raw[a] - model.verts[first+i].raw[a]));
+            }
+        }
+    }
+
+    clusters.resize((faces + CLUSTER_FACES - 1) / CLUSTER_FACES);
+    for (size_t c = 0; c < clusters.size(); c++)
+    {
+        const u32 *begin = model.tris.data() + 3*c*CLUSTER_FACES;
+        const u32 *end   = model.tris.data() + 3*std::min<size_t>(faces, (c+1)*CLUSTER_FACES);
+        auto range = std::minmax_element(begin, end);
+        Cluster &cluster = clusters[c];
+        cluster.is_wide = *range.second - *range.first > 65535;
+        if (cluster.is_wide)
+        {
+            cluster.base   = 0;
+            cluster.offset = wide.size();
+            wide.insert(wide.end(), begin, end);
+        }
+        else
+        {
+            cluster.base   = *range.first;
+            cluster.offset = narrow.size();
+            for (const u32 *i = begin; i < end; i++)
+            {
+                narrow.push_back(*i - cluster.base);
+            }
+        }
+    }
+    pos.shrink_to_fit();
+    narrow.shrink_to_fit();
+    wide.shrink_to_fit();
+}
+
+void CompactMesh::positions(size_t first, size_t n, Vec3f *out) const
+{
+    const u16 *q = pos.data() + 3*first;
+    for (size_t i = 0; i < n; i++, q += 3)
+    {
+        out[i] = Vec3f(lo.x + q[0]*step.x, lo.y + q[1]*step.y, lo.z + q[2]*step.z);
+    }
+}
+
+void CompactMesh::face_indices(size_t first, size_t n, u32 *out) const
+{
+    size_t end = first + n;
+    while (first < end)
+    {
+        const Cluster &cluster = clusters[first / CLUSTER_FACES];
+        size_t within = first % CLUSTER_FACES;
+        size_t count  = std::min(end, first - within + CLUSTER_FACES) - first;
+        if (cluster.is_wide)
+        {
+            const u32 *src = wide.data() + cluster.offset + 3*within;
+            std::copy(src, src + 3*count, out);
+        }
+        else
+        {
+            const u16 *src = narrow.data() + cluster.offset + 3*within;
+            for (size_t i = 0; i < 3*count; i++)
+            {
+                out[i] = cluster.base + src[i];
+            }
+        }
+        out   += 3*count;
+        first += count;
+    }
+}
+
+float CompactMesh::pixel_error(const Camera &camera, u32 width, u32 height) const
+{
+    float ex = camera.zoom*width/2, ey = camera.zoom*height/2;
+    return std::sqrt(ex*ex*(error.x*error.x + error.z*error.z) + ey*ey*error.y*error.y);
+}
+
+size_t CompactMesh::bytes() const
+{
+    return sizeof(*this) + pos.size()*sizeof(u16) + clusters.size()*sizeof(Cluster)
+         + narrow.size()*sizeof(u16) + wide.size()*sizeof(u32);
+}
+
+size_t CompactMesh::wide_clusters() const
+{
+    return std::count_if(clusters.begin(), clusters.end(), [](const Cluster &c) { return c.is_wide; });
+}
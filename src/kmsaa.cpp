@@ -0,0 +1,181 @@
+#include "includes/kmsaa.h"
+#include <algorithm>
+#include <string.h>
+
+using std::swap;
+
+//! Standard 2x/4x/8x sample patterns, in sixteenths of a pixel from the pixel center.
+static const s8 pattern2[2][2] = { {4, 4}, {-4, -4} };
+static const s8 pattern4[4][2] = { {-2, -6}, {6, -2}, {-6, 2}, {2, 6} };
+static const s8 pattern8[8][2] = { {1, -3}, {-1, 3}, {5, 1}, {-3, -5}, {-5, 5}, {-7, -1}, {3, 7}, {7, -7} };
+
+static const s8 (*sample_pattern(int samples))[2]
+{
+    switch (samples)
+    {
+    case 2:  return pattern2;
+    case 4:  return pattern4;
+    default: return pattern8;
+    }
+}
+
+bool msaa_supported(int samples)
+{
+    return samples == 2 || samples == 4 || samples == 8;
+}
+
+void msaa_clear(SampleTarget &target)
+{
+    size_t row_pixels = target.x1 - target.x0;
+    for (int s = 0; s < target.samples; s++)
+    {
+        for (int y = 0; y < target.y1 - target.y0; y++)
+        {
+            size_t offset = s*target.plane_stride + (size_t) y*target.pitch;
+            memset(target.color + offset*target.bytespp, 0, row_pixels*target.bytespp);
+            memset(target.depth + offset, 0, row_pixels*sizeof(u16));
+        }
+    }
+}
+
+//! Pixel (x, y) is centered on integer coordinates, as in the single-sampled passes. Unlike those, the vertices
+//! are not snapped to whole pixels by snap_face: samples are tested against the unsnapped float edges.
+void msaa_triangle(const Vec3f *pts, SampleTarget &target, TGAColor color)
+{
+    Vec3f a = pts[0], b = pts[1], c = pts[2];
+    float area = (b.x-a.x)*(c.y-a.y) - (b.y-a.y)*(c.x-a.x);
+    if (std::abs(area) < 1e-6f) return;
+    if (area < 0)
+    {
+        swap(b, c);
+        area = -area;
+    }
+
+    int xmin = std::max(target.x0,   (int) std::floor(std::min(a.x, std::min(b.x, c.x)) - .5f));
+    int xmax = std::min(target.x1-1, (int) std::ceil (std::max(a.x, std::max(b.x, c.x)) + .5f));
+    int ymin = std::max(target.y0,   (int) std::floor(std::min(a.y, std::min(b.y, c.y)) - .5f));
+    int ymax = std::min(target.y1-1, (int) std::ceil (std::max(a.y, std::max(b.y, c.y)) + .5f));
+    if (xmin > xmax || ymin > ymax) return;
+
+    // Edge functions w = A*x + B*y + C, each one zero on an edge and positive inside
+    const Vec3f *from[3] = { &b, &c, &a }, *to[3] = { &c, &a, &b };
+    float A[3], B[3], C[3];
+    for (int e = 0; e < 3; e++)
+    {
+        A[e] = -(to[e]->y - from[e]->y);
+        B[e] =   to[e]->x - from[e]->x;
+        C[e] = -(A[e]*from[e]->x + B[e]*from[e]->y);
+    }
+    float inv_area = 1.f/area;
+    float dzdx = (A[0]*a.z + A[1]*b.z + A[2]*c.z)*inv_area;
+    float dzdy = (B[0]*a.z + B[1]*b.z + B[2]*c.z)*inv_area;
+
+    const int n = target.samples;
+    const s8 (*pattern)[2] = sample_pattern(n);
+    float offset[3][8], zoffset[8];
+    for (int s = 0; s < n; s++)
+    {
+        float ox = pattern[s][0]/16.f, oy = pattern[s][1]/16.f;
+        for (int e = 0; e < 3; e++) offset[e][s] = A[e]*ox + B[e]*oy;
+        zoffset[s] = dzdx*ox + dzdy*oy;
+    }
+
+    for (int y = ymin; y <= ymax; y++)
+    {
+        float wy[3];
+        for (int e = 0; e < 3; e++) wy[e] = B[e]*y + C[e];
+        size_t row = (size_t) (y - target.y0)*target.pitch - target.x0;
+
+        for (int x = xmin; x <= xmax; x++)
+        {
+            // Evaluated per pixel rather than stepped from xmin, so coverage does not depend on where the target is clipped
+            float w[3] = { A[0]*x + wy[0], A[1]*x + wy[1], A[2]*x + wy[2] };
+            unsigned mask = 0;
+            for (int s = 0; s < n; s++)
+            {
+                if (w[0] + offset[0][s] >= 0 && w[1] + offset[1][s] >= 0 && w[2] + offset[2][s] >= 0)
+                    mask |= 1u << s;
+            }
+            if (!mask) continue;
+
+            // Shaded once for the pixel, then written to every covered sample that passes the depth test
+            float zc = (w[0]*a.z + w[1]*b.z + w[2]*c.z)*inv_area;
+            size_t idx = row + x;
+            for (int s = 0; s < n; s++)
+            {
+                if (!(mask & (1u << s))) continue;
+                float q = 1.f + (zc + zoffset[s] - target.zmin)*target.zscale;
+                u16 depth = (u16) std::min(65535.f, std::max(1.f, q));
+                size_t si = s*target.plane_stride + idx;
+                if (target.depth[si] < depth)
+                {
+                    target.depth[si] = depth;
+                    memcpy(target.color + si*target.bytespp, color.raw, target.bytespp);
+                }
+            }
+        }
+    }
+}
+
+static inline bool outside_samples(const Vec3f &a, const Vec3f &b, const Vec3f &c, const SampleTarget &target)
+{
+    float min_y = std::min(a.y, std::min(b.y, c.y)), max_y = std::max(a.y, std::max(b.y, c.y));
+    float min_x = std::min(a.x, std::min(b.x, c.x)), max_x = std::max(a.x, std::max(b.x, c.x));
+    return max_y < target.y0-1 || min_y >= target.y1+1 || max_x < target.x0-1 || min_x >= target.x1+1;
+}
+
+void msaa_gouraud_z_pass(const MeshView &view, SampleTarget &target)
+{
+    for (size_t f = 0; f < view.ntris; f++)
+    {
+        const u32 *face = view.tris + 3*f;
+        Vec3f pts[3] = { view.screen[face[0]], view.screen[face[1]], view.screen[face[2]] };
+        if (outside_samples(pts[0], pts[1], pts[2], target)) continue;
+        float intensity = face_intensity(view.world, face);
+        if (intensity)
+        {
+            msaa_triangle(pts, target, TGAColor(intensity*255, intensity*255, intensity*255, 255));
+        }
+    }
+}
+
+void msaa_random_colors_pass(const MeshView &view, SampleTarget &target)
+{
+    for (size_t f = 0; f < view.ntris; f++)
+    {
+        const u32 *face = view.tris + 3*f;
+        Vec3f pts[3] = { view.screen[face[0]], view.screen[face[1]], view.screen[face[2]] };
+        if (outside_samples(pts[0], pts[1], pts[2], target)) continue;
+        msaa_triangle(pts, target, face_color(view.face_id(f)));
+    }
+}
+
+void msaa_resolve(const SampleTarget &target, RenderTarget &out)
+{
+    const int shift = target.samples == 2 ? 1 : target.samples == 4 ? 2 : 3;
+    const u16 half  = target.samples >> 1;
+    const size_t plane_bytes = target.plane_stride*target.bytespp;
+    const size_t row_bytes   = (size_t) (target.x1 - target.x0)*target.bytespp;
+
+    // Rows are summed in chunks into a small u16 accumulator; both loops vectorize.
+    const size_t chunk = 1024;
+    u16 acc[chunk];
+    for (int y = target.y0; y < target.y1; y++)
+    {
+        const u8 *src = target.color + (size_t) (y - target.y0)*target.pitch*target.bytespp;
+        u8 *dst = out.pixels + (y - out.y0)*out.pitch + (target.x0 - out.x0)*out.bytespp;
+        for (size_t begin = 0; begin < row_bytes; begin += chunk)
+        {
+            size_t len = std::min(chunk, row_bytes - begin);
+            const u8 *p = src + begin;
+            for (size_t i = 0; i < len; i++) acc[i] = half + p[i];
+            for (int s = 1; s < target.samples; s++)
+            {
+                p = src + s*plane_bytes + begin;
+                for (size_t i = 0; i < len; i++) acc[i] += p[i];
+            }
+            u8 *d = dst + begin;
+            for (size_t i = 0; i < len; i++) d[i] = acc[i] >> shift;
+        }
+    }
+}
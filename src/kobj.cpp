@@ -0,0 +1,93 @@
+#include "includes/kobj.h"
+#include <iostream>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+bool read_obj(const char *filename, ObjVisitor &visitor) {
+    std::ifstream in;
+    in.open (filename, std::ifstream::in);
+    if (in.fail())
+    {
+        std::cerr << "Failed to load: " << filename << "\n";
+        return false;
+    }
+    return read_obj(in, visitor);
+}
+
+//! Obj parser by Dmitry V. Sokolov
+bool read_obj(std::istream &in, ObjVisitor &visitor) {
+    std::string line;
+    std::vector<int> f;
+    std::vector<int> f_t;
+    std::vector<int> f_n;
+
+    /* while we have not reached the end of the file */
+    while (!in.eof()) {
+
+        /* get one oine at a time */
+        std::getline(in, line);
+        /* make a stream from it */
+        std::istringstream iss(line.c_str());
+
+        char trash;
+
+        /* if it is a line describing vertex coordinates */
+        if (!line.compare(0, 2, "v "))
+        {
+            /* consume the 'v' symbol */
+            iss >> trash;
+            /* consume the coordinates */
+            Vec3f v;
+            for (int i=0;i<3;i++) iss >> v.raw[i];
+            /* store */
+            visitor.vertex(v);
+
+        } /* if it is a line describing vertex texture coordinates */
+        else if (!line.compare (0, 3, "vt "))
+        {
+            /* consume symbol 'v' */
+            iss >> trash;
+            /* consume symbol 't' */
+            iss >> trash;
+            /* consume the coordinates */
+            Vec3f tex;
+            for (int i=0;i<3;i++) iss >> tex.raw[i];
+            /* store */
+            visitor.texcoord(tex);
+        }
+        else if (!line.compare (0, 3, "vn "))
+        {
+            /* consume symbol 'v' */
+            iss >> trash;
+            /* consume symbol 'n' */
+            iss >> trash;
+            /* consume the coordinates */
+            Vec3f n;
+            for (int i=0;i<3;i++) iss >> n.raw[i];
+            /* store */
+            visitor.normal(n);
+        }
+        else if (!line.compare(0, 2, "f ")) {
+            /* current face, reusing the buffers of the previous one */
+            f.clear();
+            f_t.clear();
+            f_n.clear();
+
+            int idx;
+            int t_idx, n_idx;
+
+            /* consume 'f' symbol */
+            iss >> trash;
+            while (iss >> idx >> trash >> t_idx >> trash >> n_idx) {
+                idx--; // in wavefront obj all indices start at 1, not zero
+                f.push_back(idx);
+                f_t.push_back(t_idx-1);
+                f_n.push_back(n_idx-1);
+            }
+            visitor.face(f.data(), f_t.data(), f_n.data(), f.size());
+        }
+    }
+    return true;
+}
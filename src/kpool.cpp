@@ -0,0 +1,88 @@
+#include "includes/kpool.h"
+#include "includes/ktrace.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned threads) : job(NULL), job_size(0), next(0), generation(0), busy(0), stopping(false)
+{
+    if (!threads)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (unsigned i = 1; i < threads; i++)
+    {
+        workers.push_back(std::thread(&ThreadPool::worker_loop, this));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &t : workers)
+    {
+        t.join();
+    }
+}
+
+unsigned ThreadPool::size() const
+{
+    return workers.size() + 1;
+}
+
+void ThreadPool::run_items()
+{
+    int i;
+    while ((i = next.fetch_add(1)) < job_size)
+    {
+        (*job)(i);
+    }
+}
+
+void ThreadPool::worker_loop()
+{
+    trace_thread_name("pool worker");
+    unsigned seen = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+        }
+        run_items();
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            if (!--busy) done.notify_all();
+        }
+    }
+}
+
+void ThreadPool::parallel_for(int n, const std::function<void(int)> &fn)
+{
+    if (n <= 0) return;
+    if (workers.empty() || n == 1)
+    {
+        for (int i = 0; i < n; i++) fn(i);
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        job      = &fn;
+        job_size = n;
+        next     = 0;
+        busy     = workers.size();
+        generation++;
+    }
+    wake.notify_all();
+    run_items();
+
+    // Every worker checks in once per generation, so none can still be looking
+    // at this job when the next one is published.
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [&] { return busy == 0; });
+    job = NULL;
+}
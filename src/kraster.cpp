@@ -0,0 +1,130 @@
+#include "includes/kraster.h"
+#include <algorithm>
+#include <string.h>
+#include <atomic>
+
+template <ShadeMode S, int BPP>
+static inline void shade_pixel(u8 *pixel, const RasterTriangle &tri)
+{
+    if (S == SHADE_FLAT)
+    {
+        memcpy(pixel, tri.color.raw, BPP);
+    }
+    else
+    {
+        memcpy(pixel, &tri.id, 4);
+    }
+}
+
+//! Coverage comes from integer edge functions stepped across the bounding box. They are the
+//! numerators of get_bar_coord, so the same pixels are covered, and depth is interpolated with
+//! the very same float operations, so depth ties resolve as they always have.
+//! Tiny triangles go through the same loop: their few candidates are cheaper to step over
+//! than to gather into masks, which were tried and measured slower on dense meshes.
+template <ShadeMode S, int BPP>
+static RasterClass raster_triangle(const RasterTriangle &tri, RenderTarget &target)
+{
+    const Vec3f &A = tri.pts[0], &B = tri.pts[1], &C = tri.pts[2];
+    s64 ax = A.x, ay = A.y, bx = B.x, by = B.y, cx = C.x, cy = C.y;
+    s64 area = (cx-ax)*(by-ay) - (bx-ax)*(cy-ay);
+    if (!area) return RASTER_SUBPIXEL;
+    const s64 sign = area > 0 ? 1 : -1;
+
+    s64 left  = std::min(ax, std::min(bx, cx)), right = std::max(ax, std::max(bx, cx));
+    s64 lower = std::min(ay, std::min(by, cy)), upper = std::max(ay, std::max(by, cy));
+    RasterClass kind = right-left < RASTER_TINY_SPAN && upper-lower < RASTER_TINY_SPAN ? RASTER_TINY : RASTER_GENERAL;
+    int xmin = std::max<s64>(target.x0,   left);
+    int xmax = std::min<s64>(target.x1-1, right);
+    int ymin = std::max<s64>(target.y0,   lower);
+    int ymax = std::min<s64>(target.y1-1, upper);
+    if (xmin > xmax || ymin > ymax) return kind;
+
+    // u = (B-A)x(A-P) and v = (A-P)x(C-A) at the first pixel of the first row, and their steps
+    const s64 du_dx = by-ay, du_dy = -(bx-ax);
+    const s64 dv_dx = -(cy-ay), dv_dy = cx-ax;
+    s64 u_row = (bx-ax)*(ay-ymin) - (ax-xmin)*(by-ay);
+    s64 v_row = (ax-xmin)*(cy-ay) - (cx-ax)*(ay-ymin);
+    const float farea = area;
+
+    for (int y = ymin; y <= ymax; y++, u_row += du_dy, v_row += dv_dy)
+    {
+        u8    *prow = target.pixels + (y-target.y0)*target.pitch + (xmin-target.x0)*BPP;
+        float *zrow = target.depth + (y-target.y0)*target.depth_pitch + (xmin-target.x0);
+        s64 u = u_row, v = v_row;
+        for (int x = xmin; x <= xmax; x++, u += du_dx, v += dv_dx, prow += BPP)
+        {
+            if (((sign*u) | (sign*v) | (sign*(area-u-v))) < 0) continue;
+
+            float fu = u, fv = v;
+            float bc_x = 1.f - (fu+fv)/farea, bc_y = fv/farea, bc_z = fu/farea;
+            float z = A.z*bc_x;
+            z += B.z*bc_y;
+            z += C.z*bc_z;
+            float *zp = zrow + (x-xmin);
+            if (!(*zp < z)) continue;
+            *zp = z;
+            shade_pixel<S, BPP>(prow, tri);
+        }
+    }
+    return kind;
+}
+
+template <ShadeMode S>
+static RasterFunction for_format(int bytespp)
+{
+    if (S == SHADE_ID) return bytespp == 4 ? raster_triangle<S, 4> : NULL;
+    return bytespp == 3 ? raster_triangle<S, 3> : bytespp == 4 ? raster_triangle<S, 4> : NULL;
+}
+
+namespace {
+struct DispatchTable {
+    RasterFunction entries[SHADE_MODES][2];     // Shading mode, bytespp-3
+    DispatchTable()
+    {
+        for (int b = 0; b < 2; b++)
+        {
+            entries[SHADE_FLAT][b] = for_format<SHADE_FLAT>(3+b);
+            entries[SHADE_ID][b]   = for_format<SHADE_ID>(3+b);
+        }
+    }
+};
+}
+
+static const DispatchTable dispatch;
+
+RasterFunction raster_function(ShadeMode shade, int bytespp)
+{
+    if (bytespp != 3 && bytespp != 4) return NULL;
+    return dispatch.entries[shade][bytespp-3];
+}
+
+static std::atomic<u64>  stats_totals[RASTER_CLASSES];
+static std::atomic<bool> stats_enabled(false);
+
+void raster_stats_enable(bool on)
+{
+    stats_enabled = on;
+}
+
+bool raster_stats_enabled()
+{
+    return stats_enabled;
+}
+
+void raster_stats_add(const RasterStats &stats)
+{
+    for (int c = 0; c < RASTER_CLASSES; c++)
+    {
+        if (stats.triangles[c]) stats_totals[c] += stats.triangles[c];
+    }
+}
+
+RasterStats raster_stats()
+{
+    RasterStats stats;
+    for (int c = 0; c < RASTER_CLASSES; c++)
+    {
+        stats.triangles[c] = stats_totals[c];
+    }
+    return stats;
+}
@@ -1,12 +1,16 @@
 #include "includes/krender.h"
+#include "includes/kobj.h"
+#include "includes/kbvh.h"
+#include "includes/kraster.h"
 #include <iostream>
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <vector>
 #include <limits>
+#include <algorithm>
+#include <string.h>
 
-float K_FLOAT_MAX = std::numeric_limits<float>::max();
 
 
 using std::swap;
@@ -33,114 +37,154 @@ Vec3f get_bar_coord(Vec3f A, Vec3f B, Vec3f C, Vec3f P)
     return Vec3f(-1,1,1); // in this case generate negative coordinates, it will be thrown away by the rasterizator
 }
 
-void draw_z_buf_triangle(Vec3f *pts, float *zbuffer, TGAImage &image, config_t cfg, TGAColor color) {
-    Vec2f bboxmin( K_FLOAT_MAX,  K_FLOAT_MAX);
-    Vec2f bboxmax(-K_FLOAT_MAX, -K_FLOAT_MAX);
+static inline void put_pixel(RenderTarget &target, int x, int y, const TGAColor &color)
+{
+    if (x<target.x0 || y<target.y0 || x>=target.x1 || y>=target.y1) {
+        return;
+    }
+    memcpy(target.pixels + (y-target.y0)*target.pitch + (x-target.x0)*target.bytespp, color.raw, target.bytespp);
+}
 
-    Vec2f clamp(image.get_width()-1, image.get_height()-1);
-    for (int i=0; i<3; i++) {
-        bboxmin.x = std::max(0.f,      std::min(bboxmin.x, pts[i].x));
-        bboxmax.x = std::min(clamp.x,  std::max(bboxmax.x, pts[i].x));
+//! Whether the screen-space bounding box of a face (plus a pixel of rounding slack) misses target.
+static inline bool outside_target(const Vec3f &a, const Vec3f &b, const Vec3f &c, const RenderTarget &target)
+{
+    float min_y = std::min(a.y, std::min(b.y, c.y)), max_y = std::max(a.y, std::max(b.y, c.y));
+    float min_x = std::min(a.x, std::min(b.x, c.x)), max_x = std::max(a.x, std::max(b.x, c.x));
+    return max_y < target.y0-1 || min_y >= target.y1+1 || max_x < target.x0-1 || min_x >= target.x1+1;
+}
 
-        bboxmin.y = std::max(0.f,      std::min(bboxmin.y, pts[i].y));
-        bboxmax.y = std::min(clamp.y,  std::max(bboxmax.y, pts[i].y));
-    }
-    Vec3f P;
-    for (P.x=bboxmin.x; P.x<=bboxmax.x; P.x++) {
-        for (P.y=bboxmin.y; P.y<=bboxmax.y; P.y++) {
-            Vec3f bc_screen  = get_bar_coord(pts[0], pts[1], pts[2], P);
-            if (bc_screen.x<0 || bc_screen.y<0 || bc_screen.z<0) continue;
-            P.z =  pts[0].z*bc_screen.x;
-            P.z += pts[1].z*bc_screen.y;
-            P.z += pts[2].z*bc_screen.z;
-
-            if (zbuffer[int(P.x+P.y* cfg.width)]<P.z) {
-                zbuffer[int(P.x+P.y* cfg.width)] = P.z;
-                image.set(P.x, P.y, color);
-            }
-        }
+void count_raster_classes(const MeshView &view, const RenderTarget &target)
+{
+    RasterStats stats;
+    Vec3f pts[3];
+    for (size_t f=0; f<view.ntris; f++) {
+        const u32 *face = view.tris + 3*f;
+        if (outside_target(view.screen[face[0]], view.screen[face[1]], view.screen[face[2]], target)) continue;
+        snap_face(view.screen, face, pts);
+        stats.count(raster_class(pts));
     }
+    raster_stats_add(stats);
 }
 
-Vec3f world_to_screen(Vec3f v, config_t cfg) {
-    return Vec3f(int((v.x+1.)*cfg.width/2.+.5), int((v.y+1.)*cfg.height/2.+.5), v.z);
+RenderTarget image_target(TGAImage &image, float *depth)
+{
+    RenderTarget target;
+    target.pixels      = image.buffer();
+    target.bytespp     = image.get_bytespp();
+    target.pitch       = image.get_width()*target.bytespp;
+    target.depth       = depth;
+    target.depth_pitch = image.get_width();
+    target.x0 = target.y0 = 0;
+    target.x1 = image.get_width();
+    target.y1 = image.get_height();
+    return target;
 }
 
-TGAImage triangle_fill_random_colors(Model model, config_t cfg)
+void transform_vertices(const Vec3f *in, size_t n, const Camera &camera, u32 width, u32 height, Vec3f *world, Vec3f *screen)
 {
-    float *zbuffer = new float[cfg.width * cfg.height];
-    for (int i=cfg.width* cfg.height; i--;)
+    float cos_theta = cos(camera.theta);
+    float sin_theta = sin(camera.theta);
+    for (size_t i=0; i<n; i++)
     {
-        zbuffer[i] = -K_FLOAT_MAX;
-    }
-    TGAImage image(cfg.width, cfg.height, ColorMode::RGB);
-    for (std::vector<int> face : model.faces) {
-        Vec3f pts[3];
-        for (int i=0; i<3; i++) pts[i] = world_to_screen(model.verts[face[i]], cfg);
-        draw_z_buf_triangle(pts, zbuffer, image, cfg, TGAColor(rand()%255, rand()%255, rand()%255, 255));
+        Vec3f v = in[i];
+        if (camera.theta != 0)
+        {
+            float x = v.x;
+            float z = v.z;
+            v.x = x * cos_theta - z * sin_theta;
+            v.z = z * cos_theta + x * sin_theta;
+        }
+        world[i]  = v;
+        screen[i] = Vec3f(((v.x-camera.cx)*camera.zoom+1.)*width/2., ((v.y-camera.cy)*camera.zoom+1.)*height/2., v.z);
     }
-    delete[] zbuffer;
-    return image;
 }
 
-TGAImage apply_gouraud_shade_z_buffer(Model model, config_t cfg)
+TGAColor face_color(u32 face)
 {
-    float *zbuffer = new float[cfg.width * cfg.height];
-    for (int i=cfg.width* cfg.height; i--;)
-    {
-        zbuffer[i] = -K_FLOAT_MAX;
+    u32 h = face * 2654435761u;
+    h ^= h >> 15;
+    h *= 2246822519u;
+    h ^= h >> 13;
+    return TGAColor(h%255, (h>>8)%255, (h>>16)%255, 255);
+}
+
+float face_intensity(const Vec3f *world, const u32 *face)
+{
+    const Vec3f light_dir(0,0,-1);
+    Vec3f n = (world[face[2]]-world[face[0]])^(world[face[1]]-world[face[0]]);
+    n.normalize();
+    return n*light_dir;
+}
+
+void random_colors_pass(const MeshView &view, RenderTarget &target)
+{
+    RasterFunction raster = raster_function(SHADE_FLAT, target.bytespp);
+    RasterTriangle tri;
+    for (size_t f=0; f<view.ntris; f++) {
+        const u32 *face = view.tris + 3*f;
+        const Vec3f &a = view.screen[face[0]], &b = view.screen[face[1]], &c = view.screen[face[2]];
+        if (outside_target(a, b, c, target)) continue;
+        snap_face(view.screen, face, tri.pts);
+        if (is_subpixel(tri.pts)) continue;
+        tri.color = face_color(view.face_id(f));
+        raster(tri, target);
     }
-    TGAImage image(cfg.width, cfg.height, ColorMode::RGB);
-    Vec3f light_dir(0,0,-1);
-    for (std::vector<int> face : model.faces) {
-        Vec2i screen_coords[3];
-        Vec3f world_coords[3];
-        for (int j=0; j<3; j++) {
-            Vec3f v = model.verts[face[j]];
-            screen_coords[j] = Vec2i((v.x+1.)*cfg.width/2., (v.y+1.)*cfg.height/2.);
-            world_coords[j]  = v;
-        }
-        Vec3f n = (world_coords[2]-world_coords[0])^(world_coords[1]-world_coords[0]);
-        n.normalize();
-        float intensity = n*light_dir;
-        Vec3f pts[3];
-        for (int i=0; i<3; i++) pts[i] = world_to_screen(model.verts[face[i]], cfg);
+}
 
+void gouraud_z_pass(const MeshView &view, RenderTarget &target)
+{
+    RasterFunction raster = raster_function(SHADE_FLAT, target.bytespp);
+    RasterTriangle tri;
+    for (size_t f=0; f<view.ntris; f++) {
+        const u32 *face = view.tris + 3*f;
+        const Vec3f &a = view.screen[face[0]], &b = view.screen[face[1]], &c = view.screen[face[2]];
+        if (outside_target(a, b, c, target)) continue;
+        snap_face(view.screen, face, tri.pts);
+        if (is_subpixel(tri.pts)) continue;
+        float intensity = face_intensity(view.world, face);
         if (intensity)
         {
-            draw_z_buf_triangle(pts, zbuffer, image, cfg, TGAColor(intensity*255, intensity*255, intensity*255, 255));
+            tri.color = TGAColor(intensity*255, intensity*255, intensity*255, 255);
+            raster(tri, target);
         }
     }
-    delete[] zbuffer;
-    return image;
 }
 
-TGAImage apply_gouraud_shade_no_z_buffer(Model model, config_t cfg)
+void gouraud_pass(const MeshView &view, RenderTarget &target)
 {
-    TGAImage image(cfg.width, cfg.height, ColorMode::RGB);
-    Vec3f light_dir(0,0,-1);
-    for (std::vector<int> face : model.faces)
+    for (size_t f=0; f<view.ntris; f++)
     {
-        Vec2i screen_coords[3];
-        Vec3f world_coords[3];
-        for (int j=0; j<3; j++) {
-            Vec3f v = model.verts[face[j]];
-            screen_coords[j] = Vec2i((v.x+1.)*cfg.width/2., (v.y+1.)*cfg.height/2.);
-            world_coords[j]  = v;
-        }
-        Vec3f n = (world_coords[2]-world_coords[0])^(world_coords[1]-world_coords[0]);
-        n.normalize();
-        float intensity = n*light_dir;
+        const u32 *face = view.tris + 3*f;
+        const Vec3f &a = view.screen[face[0]], &b = view.screen[face[1]], &c = view.screen[face[2]];
+        if (outside_target(a, b, c, target)) continue;
+        float intensity = face_intensity(view.world, face);
         if (intensity>0)
         {
-            draw_triangle(screen_coords[0], screen_coords[1], screen_coords[2], image, TGAColor(intensity*255, intensity*255, intensity*255, 255));
+            draw_triangle(Vec2i(a.x, a.y), Vec2i(b.x, b.y), Vec2i(c.x, c.y), target, TGAColor(intensity*255, intensity*255, intensity*255, 255));
         }
     }
-    return image;
+}
+
+std::shared_ptr<const BVH> Model::bvh() const
+{
+    std::shared_ptr<const BVH> cached = std::atomic_load(&bvh_cache);
+    if (!cached)
+    {
+        // Two threads racing here both build one; either result is fine to keep
+        cached = std::make_shared<BVH>(*this);
+        std::atomic_store(&bvh_cache, cached);
+    }
+    return cached;
+}
+
+void Model::invalidate_bvh()
+{
+    std::atomic_store(&bvh_cache, std::shared_ptr<const BVH>());
 }
 
 void Model::rotate(float theta)
 {
+    invalidate_bvh();
     float cos_theta = cos(theta);
     float sin_theta = sin(theta);
 
@@ -151,91 +195,159 @@ void Model::rotate(float theta)
         vert.x = x * cos_theta - z * sin_theta;
         vert.z = z * cos_theta + x * sin_theta;
     }
+    for (Vec3f & n : norms)
+    {
+        float x = n.x;
+        float z = n.z;
+        n.x = x * cos_theta - z * sin_theta;
+        n.z = z * cos_theta + x * sin_theta;
+    }
 }
 
-//! Obj parser by Dmitry V. Sokolov
-Model::Model(const char *filename) : verts(), faces() {
-    std::ifstream in;
-    in.open (filename, std::ifstream::in);
-    if (in.fail())
+Model::Model() : verts(), tris(), norms(), tri_norms(), uvs(), tri_uvs() { }
+
+namespace {
+class ModelBuilder : public ObjVisitor {
+public:
+    Model &model;
+    ModelBuilder(Model &m) : model(m) { }
+    void vertex(const Vec3f &v) { model.verts.push_back(v); }
+    void normal(const Vec3f &n) { model.norms.push_back(n); }
+    void texcoord(const Vec3f &t) { model.uvs.push_back(Vec2f(t.x, t.y)); }
+    void face(const int *verts, const int *texcoords, const int *normals, int n)
     {
-        std::cerr << "Failed to load: " << filename << "\n";
-        return;
+        if (n >= 3) {
+            // Only the first triangle of larger polygons is kept
+            model.tris.insert(model.tris.end(), verts, verts+3);
+            model.tri_norms.insert(model.tri_norms.end(), normals, normals+3);
+            model.tri_uvs.insert(model.tri_uvs.end(), texcoords, texcoords+3);
+        }
     }
-    std::string line;
+};
+}
 
-    /* while we have not reached the end of the file */
-    while (!in.eof()) {
+Model::Model(const char *filename) : verts(), tris(), norms(), tri_norms(), uvs(), tri_uvs() {
+    ModelBuilder builder(*this);
+    if (read_obj(filename, builder))
+    {
+        finish(filename);
+    }
+}
 
-        /* get one oine at a time */
-        std::getline(in, line);
-        /* make a stream from it */
-        std::istringstream iss(line.c_str());
+Model::Model(std::istream &in, const char *name) : verts(), tris(), norms(), tri_norms(), uvs(), tri_uvs() {
+    ModelBuilder builder(*this);
+    if (read_obj(in, builder))
+    {
+        finish(name);
+    }
+}
 
-        char trash;
+void Model::finish(const char *name)
+{
+    // Faces referring to vertices that do not exist are dropped, along with their normal and uv indices
+    size_t kept = 0, nverts = verts.size();
+    bool with_norms = tri_norms.size() == tris.size(), with_uvs = tri_uvs.size() == tris.size();
+    for (size_t f = 0; f < nfaces(); f++)
+    {
+        const u32 *face = tris.data() + 3*f;
+        if (face[0] >= nverts || face[1] >= nverts || face[2] >= nverts)
+            continue;
+        for (int k = 0; k < 3; k++)
+        {
+            tris[3*kept + k] = face[k];
+            if (with_norms) tri_norms[3*kept + k] = tri_norms[3*f + k];
+            if (with_uvs)   tri_uvs[3*kept + k]   = tri_uvs[3*f + k];
+        }
+        kept++;
+    }
+    if (kept < nfaces())
+    {
+        cerr << "krender: warning: skipped " << nfaces() - kept << " faces referring to unknown vertices.\n";
+        tris.resize(3*kept);
+        if (with_norms) tri_norms.resize(3*kept);
+        if (with_uvs)   tri_uvs.resize(3*kept);
+    }
 
-        /* if it is a line describing vertex coordinates */
-        if (!line.compare(0, 2, "v "))
+    // Vertex normals and texture coordinates are all or nothing: one bad index drops them
+    for (u32 n : tri_norms)
+    {
+        if (n >= norms.size())
         {
-            /* consume the 'v' symbol */
-            iss >> trash;
-            /* consume the coordinates */
-            Vec3f v;
-            for (int i=0;i<3;i++) iss >> v.raw[i];
-            /* store */
-            verts.push_back(v);
-
-        } /* if it is a line describing vertex texture coordinates */
-        else if (!line.compare (0, 3, "vt "))
+            tri_norms.clear();
+            break;
+        }
+    }
+    for (u32 t : tri_uvs)
+    {
+        if (t >= uvs.size())
         {
-            /* consume symbol 'v' */
-            iss >> trash;
-            /* consume symbol 't' */
-            iss >> trash;
-            /* consume the coordinates */
-            Vec3f tex;
-            for (int i=0;i<3;i++) iss >> tex.raw[i];
-            /* store */
-        //    uvw_.push_back(tex);
+            tri_uvs.clear();
+            break;
         }
-        else if (!line.compare (0, 3, "vn "))
+    }
+    cerr << "krender: read model \"" << name << "\" with " << verts.size() << " vertices and " << nfaces() << " faces.\n";
+}
+
+namespace {
+//! x of a triangle edge on successive rows, stepped with integers. It follows
+//! x0 + (x1-x0)*i/rows, truncated towards zero like the float version it replaces.
+struct EdgeStepper {
+    int x0, sign, q, r, dq, dr, rows;
+    EdgeStepper(int from, int to, int nrows, int i) : x0(from), sign(to < from ? -1 : 1), rows(nrows)
+    {
+        int dx = std::abs(to - from);
+        dq = dx / rows;
+        dr = dx % rows;
+        q = r = 0;
+        if (i)
         {
-            /* consume symbol 'v' */
-            iss >> trash;
-            /* consume symbol 'n' */
-            iss >> trash;
-            /* consume the coordinates */
-            Vec3f n;
-            for (int i=0;i<3;i++) iss >> n.raw[i];
-            /* store */
-        //    normals_.push_back(n);
+            s64 n = (s64) dx*i;
+            q = n / rows;
+            r = n % rows;
         }
-        else if (!line.compare(0, 2, "f ")) {
-            /* current face */
-            std::vector<int> f;
-            std::vector<int> f_t;
-            std::vector<int> f_n;
-
-            int idx;
-            int t_idx, n_idx;
-
-            /* consume 'f' symbol */
-            iss >> trash;
-            while (iss >> idx >> trash >> t_idx >> trash >> n_idx) {
-                idx--; // in wavefront obj all indices start at 1, not zero
-                f.push_back(idx);
-                f_t.push_back(t_idx-1);
-                f_n.push_back(n_idx-1);
-            }
-            faces.push_back(f);
-        //    facestex_.push_back(f_t);
-        //    facesn_.push_back(f_n);
+    }
+    int  x() const { return x0 + sign*q; }
+    void step()
+    {
+        q += dq;
+        r += dr;
+        if (r >= rows) { r -= rows; q++; }
+    }
+};
+
+//! Fills spans of one color. Short spans are written pixel by pixel; longer ones with wide
+//! block copies of the color replicated over 48 bytes, a whole number of 3- and 4-byte pixels.
+struct SpanFill {
+    u8  pattern[48];
+    int bytespp;
+    bool replicated;
+    SpanFill(const TGAColor &color, int bpp) : bytespp(bpp), replicated(false)
+    {
+        memcpy(pattern, color.raw, 4);
+    }
+    void fill(u8 *dst, int npixels)
+    {
+        if (npixels < 16)
+        {
+            if (bytespp == 3)
+                for (int i = 0; i < npixels; i++, dst += 3) memcpy(dst, pattern, 3);
+            else
+                for (int i = 0; i < npixels; i++, dst += 4) memcpy(dst, pattern, 4);
+            return;
         }
+        if (!replicated)
+        {
+            for (int done = bytespp; done < 48; done *= 2) memcpy(pattern + done, pattern, std::min(done, 48 - done));
+            replicated = true;
+        }
+        size_t bytes = (size_t) npixels*bytespp;
+        for (; bytes >= 48; bytes -= 48, dst += 48) memcpy(dst, pattern, 48);
+        memcpy(dst, pattern, bytes);
     }
-    cerr << "krender: read model \"" << filename << "\" with " << verts.size() << " vertices and " << faces.size() << " faces.\n";
+};
 }
 
-void draw_triangle(Vec2i t0, Vec2i t1, Vec2i t2, TGAImage &image, TGAColor color) {
+void draw_triangle(Vec2i t0, Vec2i t1, Vec2i t2, RenderTarget &target, TGAColor color) {
     if (t0.y == t1.y && t0.y==t2.y)
     {
         // Degenerate triangle
@@ -246,45 +358,55 @@ void draw_triangle(Vec2i t0, Vec2i t1, Vec2i t2, TGAImage &image, TGAColor color
     if (t0.y>t2.y) { swap(t0, t2); }  // Here we sort t0, t1 and t2 from lower to upper.
     if (t1.y>t2.y) { swap(t1, t2); }
 
+    // Rows t0.y to t2.y-1, limited to the clip rectangle
     int total_height = t2.y-t0.y;
+    int first = std::max(0, target.y0-t0.y);
+    int last  = std::min(total_height, target.y1-t0.y);
+    if (first >= last) return;
+
+    SpanFill span(color, target.bytespp);
+    EdgeStepper long_edge(t0.x, t2.x, total_height, first);
 
-    for (int i=0; i<total_height; i++)
+    // Rows up to and including t1.y belong to the lower half, unless it is flat
+    int lower_rows = t1.y-t0.y;
+    int split = lower_rows ? std::min(lower_rows+1, last) : 0;
+    for (int half = 0; half < 2; half++)
     {
-        bool second_half = i>t1.y-t0.y || t1.y==t0.y;
-        int segment_height = second_half ? t2.y-t1.y : t1.y-t0.y;
-        float alpha = (float) i/total_height;
-        float beta  = (float) (i-(second_half ? t1.y-t0.y : 0))/segment_height;
-        Vec2i A = t0 + (t2-t0)*alpha;
-        Vec2i B = second_half ? t1 + (t2-t1)*beta : t0 + (t1-t0)*beta;
-        if (A.x>B.x) {
-            swap(A, B);
-        }
-        for (int j=A.x; j<=B.x; j++) {
-            image.set(j, t0.y+i, color);
+        int begin = half ? std::max(first, split) : first;
+        int end   = half ? last : std::max(first, split);
+        if (begin >= end) continue;
+        EdgeStepper short_edge = half ? EdgeStepper(t1.x, t2.x, t2.y-t1.y, begin-lower_rows)
+                                      : EdgeStepper(t0.x, t1.x, lower_rows, begin);
+        for (int i = begin; i < end; i++, long_edge.step(), short_edge.step())
+        {
+            int xa = long_edge.x(), xb = short_edge.x();
+            if (xa > xb) swap(xa, xb);
+            xa = std::max(xa, target.x0);
+            xb = std::min(xb, target.x1-1);
+            if (xa <= xb)
+            {
+                span.fill(target.pixels + (t0.y+i-target.y0)*target.pitch + (xa-target.x0)*target.bytespp, xb-xa+1);
+            }
         }
     }
 }
 
-TGAImage draw_wireframe(Model model, config_t cfg, TGAColor c)
+void wireframe_pass(const MeshView &view, RenderTarget &target, TGAColor c)
 {
-    TGAImage image(cfg.width, cfg.height, ColorMode::RGB);
-    for (vector<int> face : model.faces)
+    for (size_t f=0; f<view.ntris; f++)
     {
+        const u32 *face = view.tris + 3*f;
+        if (outside_target(view.screen[face[0]], view.screen[face[1]], view.screen[face[2]], target)) continue;
         for (u8 j=0; j<3; j++)
         {
-            Vec3f v0 = model.verts[face[j]];
-            Vec3f v1 = model.verts[face[(j+1)%3]];
-            int x0 = (v0.x+1.)*cfg.width/2.;
-            int y0 = (v0.y+1.)*cfg.height/2.;
-            int x1 = (v1.x+1.)*cfg.width/2.;
-            int y1 = (v1.y+1.)*cfg.height/2.;
-            draw_line(x0, y0, x1, y1, image, c);
+            const Vec3f &v0 = view.screen[face[j]];
+            const Vec3f &v1 = view.screen[face[(j+1)%3]];
+            draw_line(v0.x, v0.y, v1.x, v1.y, target, c);
         }
     }
-    return image;
 }
 
-void draw_line(s32 xi, s32 yi, s32 xf, s32 yf, TGAImage &image, TGAColor color)
+void draw_line(s32 xi, s32 yi, s32 xf, s32 yf, RenderTarget &target, TGAColor color)
 {
     bool steep = false;
     if (abs(xi-xf)<abs(yi-yf))
@@ -306,7 +428,7 @@ void draw_line(s32 xi, s32 yi, s32 xf, s32 yf, TGAImage &image, TGAColor color)
     {
         for(int x = xi; x<=xf; ++x)
         {
-            image.set(y, x, color);
+            put_pixel(target, y, x, color);
             err2 += derr2;
             if(err2 > dx)
             {
@@ -319,7 +441,7 @@ void draw_line(s32 xi, s32 yi, s32 xf, s32 yf, TGAImage &image, TGAColor color)
     {
         for(int x = xi; x<=xf; ++x)
         {
-            image.set(x, y, color);
+            put_pixel(target, x, y, color);
             err2 += derr2;
             if(err2 > dx)
             {
@@ -0,0 +1,433 @@
+#include "includes/kserver.h"
+#include "includes/kcontext.h"
+#include "includes/kio.h"
+#include "includes/kchannel.h"
+#include "includes/ktrace.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <list>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+using std::cerr;
+using std::string;
+using std::list;
+using std::istringstream;
+using std::ostringstream;
+
+//! kserver: keeps parsed models and scratch buffers alive between requests.
+
+struct CacheEntry {
+    string                       key;
+    time_t                       mtime;
+    std::shared_ptr<const Model> model;
+
+    CacheEntry(const string &k, time_t t, std::shared_ptr<const Model> m) : key(k), mtime(t), model(m) { }
+};
+
+//! Models are keyed by path, or by "#" and their content hash when they were uploaded.
+class ModelCache {
+    list<CacheEntry> entries;   // Most recently used first
+    std::unordered_map<string, list<CacheEntry>::iterator> index;
+    size_t capacity;
+
+    void insert(const string &key, time_t mtime, std::shared_ptr<const Model> model)
+    {
+        entries.emplace_front(key, mtime, model);
+        index[key] = entries.begin();
+        while (entries.size() > capacity)
+        {
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
+    }
+
+public:
+    ModelCache(size_t cap) : capacity(cap) { }
+
+    //! Returns the model at path, or NULL with err set.
+    std::shared_ptr<const Model> get(const string &path, string &err)
+    {
+        if (!path.empty() && path[0] == '#')
+        {
+            auto it = index.find(path);
+            if (it == index.end())
+            {
+                err = "unknown model " + path;
+                return NULL;
+            }
+            entries.splice(entries.begin(), entries, it->second);
+            return entries.front().model;
+        }
+
+        struct stat st;
+        if (stat(path.c_str(), &st))
+        {
+            err = "can't stat " + path;
+            return NULL;
+        }
+
+        auto it = index.find(path);
+        if (it != index.end() && it->second->mtime != st.st_mtime)
+        {
+            entries.erase(it->second);
+            index.erase(it);
+            it = index.end();
+        }
+
+        if (it == index.end())
+        {
+            std::shared_ptr<const Model> model = std::make_shared<Model>(path.c_str());
+            if (model->verts.empty())
+            {
+                err = "couldn't load " + path;
+                return NULL;
+            }
+            insert(path, st.st_mtime, model);
+        }
+        else
+        {
+            entries.splice(entries.begin(), entries, it->second);
+        }
+        return entries.front().model;
+    }
+
+    //! Caches a model uploaded under key, replacing any previous one.
+    void put(const string &key, std::shared_ptr<const Model> model)
+    {
+        auto it = index.find(key);
+        if (it != index.end())
+        {
+            entries.erase(it->second);
+            index.erase(it);
+        }
+        insert(key, 0, model);
+    }
+};
+
+struct ServerState {
+    ModelCache    cache;
+    RenderContext ctx;
+    TGAImage      frame;    // Reused while requests keep the same size
+
+    ServerState(config_t cfg) : cache(cfg.cache_size), ctx(cfg.threads) { }
+};
+
+u64 content_hash(const char *data, size_t n)
+{
+    u64 h = 14695981039346656037ull;
+    for (size_t i = 0; i < n; i++)
+    {
+        h ^= (u8) data[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+string hash_key(u64 hash)
+{
+    char key[18];
+    snprintf(key, sizeof(key), "#%016llx", (unsigned long long) hash);
+    return key;
+}
+
+//! Largest .OBJ a client may upload; bigger ones are read past without being kept
+const size_t MAX_UPLOAD_BYTES = (size_t) 1 << 30;
+//! Largest frame a request may ask for, counting a color and a depth value per sample
+const u64    MAX_FRAME_BYTES  = (u64) 1 << 30;
+const u64    BYTES_PER_SAMPLE = 8;
+
+//! Lets an istream parse a buffer where it is, where an istringstream would copy it
+struct MemoryBuffer : std::streambuf {
+    MemoryBuffer(char *data, size_t n) { setg(data, data, data + n); }
+};
+
+//! model <key> <bytes>, followed by the .OBJ data
+static void handle_upload(istringstream &iss, ServerState &st, Channel &channel, string &reply)
+{
+    string key, data;
+    size_t bytes;
+    if (!(iss >> key >> bytes) || key.size() != 17 || key[0] != '#')
+    {
+        reply = "error malformed model upload\n";
+        return;
+    }
+    if (bytes > MAX_UPLOAD_BYTES)
+    {
+        // Still consumed, so that the next request line is found where the client expects it
+        channel.skip_bytes(bytes);
+        reply = "error model of " + std::to_string(bytes) + " bytes is over the " + std::to_string(MAX_UPLOAD_BYTES) + " byte limit\n";
+        return;
+    }
+    // Read straight from the socket into data, which the parser then reads in place
+    if (!channel.read_bytes(bytes, data))
+    {
+        return;
+    }
+    KTRACE("model upload");
+    if (hash_key(content_hash(data.data(), data.size())) != key)
+    {
+        reply = "error content does not match " + key + "\n";
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    MemoryBuffer buffer(&data[0], data.size());
+    std::istream in(&buffer);
+    std::shared_ptr<const Model> model = std::make_shared<Model>(in, key.c_str());
+    if (model->verts.empty())
+    {
+        reply = "error couldn't parse " + key + "\n";
+        return;
+    }
+    st.cache.put(key, model);
+    auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+    reply = "ok 0 " + std::to_string(elapsed.count()) + "\n";
+}
+
+//! Handles a single request line, filling reply. Returns false once the client asked us to quit.
+//! Requests from remote (TCP) clients may only render uploaded models into inline outputs
+//! and cannot stop the server, since nothing authenticates them.
+static bool handle_request(const string &line, ServerState &st, Channel &channel, bool remote, string &reply)
+{
+    reply.clear();
+    istringstream iss(line);
+    string cmd;
+    if (!(iss >> cmd))
+    {
+        return true;
+    }
+    if (cmd == "quit")
+    {
+        if (remote)
+        {
+            reply = "error quit is not accepted over TCP\n";
+            return true;
+        }
+        reply = "ok 0 0\n";
+        return false;
+    }
+    if (cmd == "model")
+    {
+        handle_upload(iss, st, channel, reply);
+        return true;
+    }
+    if (cmd != "render")
+    {
+        reply = "error unknown command \"" + cmd + "\"\n";
+        return true;
+    }
+
+    KTRACE("render request");
+    auto start = std::chrono::steady_clock::now();
+    string path;
+    float theta;
+    int width, height;
+    if (!(iss >> path >> theta >> width >> height) || width <= 0 || height <= 0 || width > 32767 || height > 32767)
+    {
+        reply = "error malformed render request\n";
+        return true;
+    }
+    if (remote && path[0] != '#')
+    {
+        reply = "error only uploaded models can be rendered over TCP\n";
+        return true;
+    }
+
+    vector<std::pair<string, string>> outputs;
+    string token;
+    int samples = 1;
+    int tile[4] = { 0, 0, width, height };
+    float view[3] = { 0, 0, 1 };
+    while (iss >> token)
+    {
+        size_t eq = token.find('=');
+        if (eq == string::npos || eq == 0 || eq + 1 == token.size())
+        {
+            reply = "error malformed output \"" + token + "\"\n";
+            return true;
+        }
+        if (!token.compare(0, eq, "tile"))
+        {
+            if (sscanf(token.c_str() + eq + 1, "%d,%d,%d,%d", &tile[0], &tile[1], &tile[2], &tile[3]) != 4 ||
+                tile[0] < 0 || tile[1] < 0 || tile[0] >= tile[2] || tile[1] >= tile[3] || tile[2] > width || tile[3] > height)
+            {
+                reply = "error bad tile \"" + token + "\"\n";
+                return true;
+            }
+            continue;
+        }
+        if (!token.compare(0, eq, "view"))
+        {
+            if (sscanf(token.c_str() + eq + 1, "%f,%f,%f", &view[0], &view[1], &view[2]) != 3 || !(view[2] > 0))
+            {
+                reply = "error bad view \"" + token + "\"\n";
+                return true;
+            }
+            continue;
+        }
+        if (!token.compare(0, eq, "msaa"))
+        {
+            samples = std::atoi(token.c_str() + eq + 1);
+            if (samples != 1 && !msaa_supported(samples))
+            {
+                reply = "error unsupported msaa \"" + token + "\"\n";
+                return true;
+            }
+            continue;
+        }
+        if (remote && token.compare(eq + 1, string::npos, "-"))
+        {
+            reply = "error only inline outputs can be requested over TCP\n";
+            return true;
+        }
+        outputs.push_back(std::make_pair(token.substr(0, eq), token.substr(eq + 1)));
+    }
+    if (outputs.empty())
+    {
+        reply = "error no outputs requested\n";
+        return true;
+    }
+    if ((u64) width*height*samples*BYTES_PER_SAMPLE > MAX_FRAME_BYTES)
+    {
+        reply = "error " + std::to_string(width) + " x " + std::to_string(height) + " at msaa=" + std::to_string(samples)
+              + " is over the " + std::to_string(MAX_FRAME_BYTES) + " byte frame budget\n";
+        return true;
+    }
+
+    vector<RenderMode> modes(outputs.size());
+    for (size_t i = 0; i < outputs.size(); i++)
+    {
+        if (!parse_render_mode(outputs[i].first.c_str(), modes[i]))
+        {
+            reply = "error unknown mode \"" + outputs[i].first + "\"\n";
+            return true;
+        }
+    }
+
+    string err;
+    std::shared_ptr<const Model> model = st.cache.get(path, err);
+    if (!model)
+    {
+        reply = "error " + err + "\n";
+        return true;
+    }
+    st.ctx.set_model(model);
+    st.ctx.set_rotation(theta);
+    st.ctx.set_view(view[0], view[1], view[2]);
+    st.ctx.set_samples(samples);
+
+    int tile_width = tile[2] - tile[0], tile_height = tile[3] - tile[1];
+    if (st.frame.get_width() != tile_width || st.frame.get_height() != tile_height)
+    {
+        st.frame = TGAImage(tile_width, tile_height, RGB);
+    }
+    TGAImage &image = st.frame;
+    RenderTarget target = image_target(image);
+    target.x0 = tile[0];
+    target.y0 = tile[1];
+    target.x1 = tile[2];
+    target.y1 = tile[3];
+
+    string body;
+    for (size_t i = 0; i < outputs.size(); i++)
+    {
+        const auto &output = outputs[i];
+        st.ctx.render(modes[i], width, height, target);
+        if (output.second == "-")
+        {
+            ostringstream encoded;
+            if (!write_tga(image, encoded, true, &st.ctx.thread_pool()))
+            {
+                reply = "error couldn't encode " + output.first + "\n";
+                return true;
+            }
+            string data = encoded.str();
+            body += output.first + " - " + std::to_string(data.size()) + "\n";
+            body += data;
+        }
+        else
+        {
+            std::ofstream file(output.second.c_str(), std::ios::binary);
+            if (!file.is_open() || !write_tga(image, file, true, &st.ctx.thread_pool()))
+            {
+                reply = "error couldn't write " + output.second + "\n";
+                return true;
+            }
+            body += output.first + " " + output.second + "\n";
+        }
+    }
+
+    auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+    ostringstream header;
+    header << "ok " << outputs.size() << " " << elapsed.count() << "\n";
+    reply = header.str() + body;
+    return true;
+}
+
+//! Serves one client. Returns false if the client asked the server to quit.
+static bool serve_connection(Channel &channel, ServerState &st, bool remote)
+{
+    string line, reply;
+    while (channel.read_line(line))
+    {
+        bool keep_going = handle_request(line, st, channel, remote, reply);
+        if (!channel.write(reply))
+            return true;
+        if (!keep_going)
+            return false;
+    }
+    return true;
+}
+
+static int serve_socket(const char *address, bool allow_remote, ServerState &st)
+{
+    int fd = channel_listen(address, allow_remote);
+    if (fd < 0)
+    {
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    cerr << "krender: serving on \"" << address << "\".\n";
+
+    for (;;)
+    {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0)
+        {
+            if (errno == EINTR) continue;
+            cerr << "krender: error: accept failed: " << strerror(errno) << "\n";
+            break;
+        }
+        Channel channel(client, client);
+        bool keep_going = serve_connection(channel, st, is_tcp_address(address));
+        close(client);
+        if (!keep_going) break;
+    }
+    close(fd);
+    if (!is_tcp_address(address))
+    {
+        unlink(address);
+    }
+    return 0;
+}
+
+int run_server(config_t cfg)
+{
+    ServerState st(cfg);
+    if (!strcmp(cfg.socket_path, "-"))
+    {
+        Channel channel(STDIN_FILENO, STDOUT_FILENO);
+        signal(SIGPIPE, SIG_IGN);
+        serve_connection(channel, st, false);
+        return 0;
+    }
+    return serve_socket(cfg.socket_path, cfg.allow_remote, st);
+}
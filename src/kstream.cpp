@@ -0,0 +1,98 @@
+#include "includes/kstream.h"
+#include "includes/kobj.h"
+#include "includes/ktrace.h"
+
+namespace {
+class StreamBuilder : public ObjVisitor {
+public:
+    std::vector<Vec3f>         verts;
+    BoundedQueue<FaceBatch *> &full, &empty;
+    FaceBatch                 *batch;
+    size_t                     batch_faces, nfaces, nskipped;
+    bool                       cancelled;
+
+    StreamBuilder(BoundedQueue<FaceBatch *> &f, BoundedQueue<FaceBatch *> &e, size_t b)
+        : full(f), empty(e), batch(NULL), batch_faces(b), nfaces(0), nskipped(0), cancelled(false) { }
+
+    void vertex(const Vec3f &v) { verts.push_back(v); }
+
+    void face(const int *idx, const int *, const int *, int n)
+    {
+        if (n < 3 || cancelled) return;
+        for (int i = 0; i < 3; i++)
+        {
+            // Faces may only refer to vertices seen so far
+            if (idx[i] < 0 || (size_t) idx[i] >= verts.size())
+            {
+                nskipped++;
+                return;
+            }
+        }
+        if (!batch)
+        {
+            if (!empty.pop(batch))
+            {
+                cancelled = true;
+                return;
+            }
+            batch->first_face = nfaces;
+            batch->nfaces     = 0;
+        }
+        Vec3f *out = batch->verts.data() + 3*batch->nfaces;
+        for (int i = 0; i < 3; i++) out[i] = verts[idx[i]];
+        nfaces++;
+        if (++batch->nfaces == batch_faces)
+        {
+            flush();
+        }
+    }
+
+    void flush()
+    {
+        if (batch && !full.push(batch)) cancelled = true;
+        batch = NULL;
+    }
+};
+}
+
+FaceStream::FaceStream(const char *filename, size_t batch_size, size_t depth)
+    : storage(depth), full(depth), empty(depth), batch_faces(batch_size), opened(false), nverts(0), nfaces(0), nskipped(0)
+{
+    for (FaceBatch &b : storage)
+    {
+        b.verts.resize(3*batch_size);
+        empty.push(&b);
+    }
+    parser = std::thread(&FaceStream::parse, this, filename);
+}
+
+FaceStream::~FaceStream()
+{
+    // Unblocks the parser if the consumer gave up early
+    full.close();
+    empty.close();
+    parser.join();
+}
+
+void FaceStream::parse(const char *filename)
+{
+    trace_thread_name("obj parser");
+    KTRACE("parse");
+    StreamBuilder builder(full, empty, batch_faces);
+    opened = read_obj(filename, builder);
+    builder.flush();
+    nverts   = builder.verts.size();
+    nfaces   = builder.nfaces;
+    nskipped = builder.nskipped;
+    full.close();
+}
+
+bool FaceStream::next(FaceBatch *&batch)
+{
+    return full.pop(batch);
+}
+
+void FaceStream::release(FaceBatch *batch)
+{
+    empty.push(batch);
+}
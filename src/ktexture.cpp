@@ -0,0 +1,118 @@
+#include "includes/ktexture.h"
+#include <algorithm>
+#include <cmath>
+
+Texture::Texture() { }
+
+Texture::Texture(TGAImage &image)
+{
+    build(image);
+}
+
+bool Texture::load(const char *filename)
+{
+    TGAImage image;
+    if (!image.read_tga_file(filename))
+    {
+        return false;
+    }
+    build(image);
+    return true;
+}
+
+static inline u32 pack_bgra(u8 b, u8 g, u8 r, u8 a)
+{
+    return b | (g << 8) | (r << 16) | ((u32) a << 24);
+}
+
+void Texture::build(TGAImage &image)
+{
+    mips.clear();
+    int w = image.get_width(), h = image.get_height(), bpp = image.get_bytespp();
+    if (w <= 0 || h <= 0)
+    {
+        return;
+    }
+
+    Level base;
+    base.width   = w;
+    base.height  = h;
+    base.tiles_x = (w + 3) / 4;
+    base.texels.assign((size_t) base.tiles_x * ((h + 3) / 4) * 16, 0);
+    const u8 *data = image.buffer();
+    for (int y = 0; y < h; y++)
+    {
+        // Images are loaded top-down; level rows run bottom-up like v
+        const u8 *row = data + (size_t) (h - 1 - y)*w*bpp;
+        for (int x = 0; x < w; x++)
+        {
+            const u8 *p = row + x*bpp;
+            u32 texel = bpp == GRAYSCALE ? pack_bgra(p[0], p[0], p[0], 255)
+                                         : pack_bgra(p[0], p[1], p[2], bpp == RGBA ? p[3] : 255);
+            base.texels[tiled_index(base, x, y)] = texel;
+        }
+    }
+    mips.push_back(base);
+
+    while (mips.back().width > 1 || mips.back().height > 1)
+    {
+        const Level &src = mips.back();
+        Level dst;
+        dst.width   = std::max(1, src.width / 2);
+        dst.height  = std::max(1, src.height / 2);
+        dst.tiles_x = (dst.width + 3) / 4;
+        dst.texels.assign((size_t) dst.tiles_x * ((dst.height + 3) / 4) * 16, 0);
+        for (int y = 0; y < dst.height; y++)
+        {
+            int y0 = std::min(2*y, src.height - 1), y1 = std::min(2*y + 1, src.height - 1);
+            for (int x = 0; x < dst.width; x++)
+            {
+                int x0 = std::min(2*x, src.width - 1), x1 = std::min(2*x + 1, src.width - 1);
+                u32 q[4] = { src.texels[tiled_index(src, x0, y0)], src.texels[tiled_index(src, x1, y0)],
+                             src.texels[tiled_index(src, x0, y1)], src.texels[tiled_index(src, x1, y1)] };
+                u32 texel = 0;
+                for (int c = 0; c < 32; c += 8)
+                {
+                    u32 sum = ((q[0] >> c) & 255) + ((q[1] >> c) & 255) + ((q[2] >> c) & 255) + ((q[3] >> c) & 255);
+                    texel |= ((sum + 2) >> 2) << c;
+                }
+                dst.texels[tiled_index(dst, x, y)] = texel;
+            }
+        }
+        mips.push_back(dst);
+    }
+}
+
+TGAColor Texture::sample(float u, float v, float lod) const
+{
+    if (mips.empty())
+    {
+        return TGAColor(255, 255, 255, 255);
+    }
+    int index = std::min<int>(mips.size() - 1, std::max(0, (int) std::floor(lod + .5f)));
+    const Level &level = mips[index];
+
+    // Texel centers sit at half-integer coordinates
+    float fx = (u - std::floor(u))*level.width - .5f;
+    float fy = (v - std::floor(v))*level.height - .5f;
+    int   x0 = (int) std::floor(fx), y0 = (int) std::floor(fy);
+    float ax = fx - x0, ay = fy - y0;
+    int   x1 = x0 + 1, y1 = y0 + 1;
+    if (x0 < 0)             x0 += level.width;
+    if (y0 < 0)             y0 += level.height;
+    if (x1 >= level.width)  x1 -= level.width;
+    if (y1 >= level.height) y1 -= level.height;
+
+    u32 q[4] = { level.texels[tiled_index(level, x0, y0)], level.texels[tiled_index(level, x1, y0)],
+                 level.texels[tiled_index(level, x0, y1)], level.texels[tiled_index(level, x1, y1)] };
+    float w[4] = { (1-ax)*(1-ay), ax*(1-ay), (1-ax)*ay, ax*ay };
+    TGAColor color;
+    color.bytespp = 4;
+    for (int c = 0; c < 4; c++)
+    {
+        float sum = 0;
+        for (int i = 0; i < 4; i++) sum += w[i]*((q[i] >> (8*c)) & 255);
+        color.raw[c] = (u8) (sum + .5f);
+    }
+    return color;
+}
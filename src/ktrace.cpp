@@ -0,0 +1,143 @@
+#include "includes/ktrace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+std::atomic<bool> trace_active(false);
+
+namespace {
+
+//! Events kept per thread: 32 bytes each, so 1 MiB
+const u64 TRACE_CAPACITY = 1 << 15;
+
+struct TraceEvent {
+    const char *name;
+    s64         index;
+    u64         begin, end;
+};
+
+//! Only its thread writes to it; published counts up to `written` are complete.
+struct TraceBuffer {
+    TraceEvent       events[TRACE_CAPACITY];
+    std::atomic<u64> written;
+    u32              tid;
+    const char      *name;
+};
+
+std::mutex                             registry_lock;
+std::vector<TraceBuffer *>             buffers;
+std::string                            trace_file;
+std::chrono::steady_clock::time_point  trace_epoch;
+thread_local TraceBuffer              *local = NULL;
+
+TraceBuffer *thread_buffer()
+{
+    if (!local)
+    {
+        local = new TraceBuffer;
+        local->written = 0;
+        local->name    = NULL;
+        std::unique_lock<std::mutex> guard(registry_lock);
+        local->tid = buffers.size() + 1;
+        buffers.push_back(local);
+    }
+    return local;
+}
+
+void trace_flush()
+{
+    trace_active = false;
+    FILE *out = fopen(trace_file.c_str(), "w");
+    if (!out)
+    {
+        std::cerr << "krender: error: couldn't open trace file \"" << trace_file << "\".\n";
+        return;
+    }
+    std::unique_lock<std::mutex> guard(registry_lock);
+    int pid = getpid();
+    u64 events = 0, lost = 0;
+    const char *separator = "\n";
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (TraceBuffer *buffer : buffers)
+    {
+        if (buffer->name)
+        {
+            fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                    separator, pid, buffer->tid, buffer->name);
+            separator = ",\n";
+        }
+        u64 written = buffer->written.load(std::memory_order_acquire);
+        u64 first   = written > TRACE_CAPACITY ? written - TRACE_CAPACITY : 0;
+        lost   += first;
+        events += written - first;
+        for (u64 i = first; i < written; i++)
+        {
+            const TraceEvent &e = buffer->events[i % TRACE_CAPACITY];
+            fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                    separator, e.name, pid, buffer->tid, e.begin / 1e3, (e.end - e.begin) / 1e3);
+            if (e.index >= 0)
+            {
+                fprintf(out, ",\"args\":{\"index\":%lld}", e.index);
+            }
+            fputc('}', out);
+            separator = ",\n";
+        }
+    }
+    fprintf(out, "\n]}\n");
+    if (fclose(out))
+    {
+        std::cerr << "krender: error: couldn't write trace file \"" << trace_file << "\".\n";
+        return;
+    }
+    std::cerr << "krender: wrote " << events << " trace events to \"" << trace_file << "\".\n";
+    if (lost)
+    {
+        std::cerr << "krender: warning: the oldest " << lost << " trace events were overwritten.\n";
+    }
+}
+
+}
+
+bool trace_start(const char *filename)
+{
+    if (trace_active)
+    {
+        return false;
+    }
+    trace_file  = filename;
+    trace_epoch = std::chrono::steady_clock::now();
+    trace_active = true;
+    trace_thread_name("main");
+    atexit(trace_flush);
+    return true;
+}
+
+void trace_thread_name(const char *name)
+{
+    if (trace_active)
+    {
+        thread_buffer()->name = name;
+    }
+}
+
+u64 trace_now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - trace_epoch).count();
+}
+
+void trace_record(const char *name, s64 index, u64 begin, u64 end)
+{
+    TraceBuffer *buffer = thread_buffer();
+    u64 n = buffer->written.load(std::memory_order_relaxed);
+    TraceEvent &e = buffer->events[n % TRACE_CAPACITY];
+    e.name  = name;
+    e.index = index;
+    e.begin = begin;
+    e.end   = end;
+    buffer->written.store(n + 1, std::memory_order_release);
+}
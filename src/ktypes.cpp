@@ -42,7 +42,16 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <vector>
+#include <iterator>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "includes/ktypes.h"
+#include "includes/kimage.h"
+#include "includes/ktrace.h"
 
 TGAImage::TGAImage()
 {
@@ -92,115 +101,178 @@ TGAImage& TGAImage::operator =(const TGAImage &img) {
     return *this;
 }
 
+//! Maps filename read-only and hands it to read_tga_memory; files that cannot be mapped are read whole.
 bool TGAImage::read_tga_file(const char *filename) {
-    if (data) delete [] data;
-    data = NULL;
-    std::ifstream in;
-    in.open (filename, std::ios::binary);
-    if (!in.is_open()) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
         std::cerr << "can't open file " << filename << "\n";
-        in.close();
         return false;
     }
-    TGA_Header header;
-    in.read((char *)&header, sizeof(header));
-    if (!in.good()) {
-        in.close();
-        std::cerr << "an error occured while reading the header\n";
-        return false;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    bool ok;
+    if (map != MAP_FAILED) {
+        ok = read_tga_memory((const u8 *) map, st.st_size);
+        munmap(map, st.st_size);
+    } else {
+        std::ifstream in(filename, std::ios::binary);
+        std::vector<char> contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        ok = read_tga_memory((const u8 *) contents.data(), contents.size());
     }
-    width   = header.width;
-    height  = header.height;
-    bytespp = header.bitsperpixel>>3;
-    if (width<=0 || height<=0 || (bytespp!=GRAYSCALE && bytespp!=RGB && bytespp!=RGBA)) {
-        in.close();
-        std::cerr << "bad bpp (or width/height) value\n";
+    close(fd);
+    return ok;
+}
+
+//! Writes the n bpp-byte pixels at src to dst in reverse order
+static inline void copy_reversed(u8 *dst, const u8 *src, size_t n, int bpp) {
+    for (u8 *p = dst + (n-1)*bpp; n--; p -= bpp, src += bpp) {
+        memcpy(p, src, bpp);
+    }
+}
+
+bool TGAImage::read_tga_memory(const u8 *src, size_t size) {
+    // Images of the same size are decoded into the existing buffer
+    size_t old_bytes = data ? (size_t) width*height*bytespp : 0;
+    auto fail = [this](const char *message) {
+        std::cerr << message;
+        delete [] data;
+        data = NULL;
+        width = height = bytespp = 0;
         return false;
+    };
+
+    TGA_Header header;
+    if (size < sizeof(header)) {
+        return fail("an error occured while reading the header\n");
     }
-    unsigned long nbytes = bytespp*width*height;
-    data = new unsigned char[nbytes];
+    memcpy(&header, src, sizeof(header));
+    int w = header.width, h = header.height, bpp = header.bitsperpixel>>3;
+    if (w<=0 || h<=0 || (bpp!=GRAYSCALE && bpp!=RGB && bpp!=RGBA)) {
+        return fail("bad bpp (or width/height) value\n");
+    }
+    // The image ID and any color map (unused by the types below) sit between header and pixels
+    size_t offset = sizeof(header) + (u8) header.idlength;
+    if (header.colormaptype) {
+        offset += (size_t) (u16) header.colormaplength * (((u8) header.colormapdepth + 7) >> 3);
+    }
+    if (offset > size) {
+        return fail("an error occured while reading the header\n");
+    }
+    src  += offset;
+    size -= offset;
+
+    width   = w;
+    height  = h;
+    bytespp = bpp;
+    size_t row_bytes = (size_t) width*bytespp;
+    if (row_bytes*height != old_bytes) {
+        if (data) delete [] data;
+        data = new unsigned char[row_bytes*height];
+    }
+
+    // Rows are stored bottom-up unless bit 5 is set, and right-to-left when bit 4 is set;
+    // both are undone as the pixels are written
+    bool top_down = header.imagedescriptor & 0x20;
+    bool right_to_left = header.imagedescriptor & 0x10;
+    bool ok;
     if (3==header.datatypecode || 2==header.datatypecode) {
-        in.read((char *)data, nbytes);
-        if (!in.good()) {
-            in.close();
-            std::cerr << "an error occured while reading the data\n";
-            return false;
+        ok = size >= row_bytes*height;
+        if (ok && top_down && !right_to_left) {
+            memcpy(data, src, row_bytes*height);
+        } else if (ok) {
+            for (int y=0; y<height; y++) {
+                u8 *dst = data + (top_down ? y : height-1-y)*row_bytes;
+                if (right_to_left) {
+                    copy_reversed(dst, src + y*row_bytes, width, bytespp);
+                } else {
+                    memcpy(dst, src + y*row_bytes, row_bytes);
+                }
+            }
         }
     } else if (10==header.datatypecode||11==header.datatypecode) {
-        if (!load_rle_data(in)) {
-            in.close();
-            std::cerr << "an error occured while reading the data\n";
-            return false;
-        }
+        ok = load_rle_data(src, size, top_down, right_to_left);
     } else {
-        in.close();
         std::cerr << "unknown file format " << (int)header.datatypecode << "\n";
-        return false;
+        return fail("");
     }
-    if (!(header.imagedescriptor & 0x20)) {
-        flip_vertically();
-    }
-    if (header.imagedescriptor & 0x10) {
-        flip_horizontally();
+    if (!ok) {
+        return fail("an error occured while reading the data\n");
     }
     std::cerr << width << "x" << height << "/" << bytespp*8 << "\n";
-    in.close();
     return true;
 }
 
-bool TGAImage::load_rle_data(std::ifstream &in) {
-    unsigned long pixelcount = width*height;
-    unsigned long currentpixel = 0;
-    unsigned long currentbyte  = 0;
-    TGAColor colorbuffer;
-    do {
-        unsigned char chunkheader = 0;
-        chunkheader = in.get();
-        if (!in.good()) {
-            std::cerr << "an error occured while reading the data\n";
+//! Writes n copies of the bpp-byte pixel at dst by doubling what was already written
+static inline void fill_pixels(u8 *dst, const u8 *pixel, size_t n, int bpp) {
+    if (1==bpp) {
+        memset(dst, pixel[0], n);
+        return;
+    }
+    size_t total = n*bpp, done = bpp;
+    memcpy(dst, pixel, bpp);
+    while (done < total) {
+        size_t chunk = std::min(done, total-done);
+        memcpy(dst+done, dst, chunk);
+        done += chunk;
+    }
+}
+
+//! Packets may run across rows, so each one is split at row ends and every piece goes
+//! straight to its final row.
+bool TGAImage::load_rle_data(const u8 *src, size_t size, bool top_down, bool right_to_left) {
+    const u8 *end = src + size;
+    size_t row_bytes = (size_t) width*bytespp;
+    int row = 0, x = 0;
+    u8 *dst = data + (top_down ? 0 : (height-1)*row_bytes);
+    while (row < height) {
+        if (src >= end) {
             return false;
         }
-        if (chunkheader<128) {
-            chunkheader++;
-            for (int i=0; i<chunkheader; i++) {
-                in.read((char *)colorbuffer.raw, bytespp);
-                if (!in.good()) {
-                    std::cerr << "an error occured while reading the header\n";
-                    return false;
-                }
-                for (int t=0; t<bytespp; t++)
-                    data[currentbyte++] = colorbuffer.raw[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
-            }
-        } else {
-            chunkheader -= 127;
-            in.read((char *)colorbuffer.raw, bytespp);
-            if (!in.good()) {
-                std::cerr << "an error occured while reading the header\n";
+        u8 chunkheader = *src++;
+        bool raw = chunkheader < 128;
+        size_t n = (chunkheader & 127) + 1;
+        if ((size_t) (end - src) < (raw ? n : 1)*bytespp) {
+            return false;
+        }
+        const u8 *pixel = src;
+        src += (raw ? n : 1)*bytespp;
+        while (n) {
+            if (row >= height) {
+                std::cerr << "Too many pixels read\n";
                 return false;
             }
-            for (int i=0; i<chunkheader; i++) {
-                for (int t=0; t<bytespp; t++)
-                    data[currentbyte++] = colorbuffer.raw[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
+            size_t k = std::min<size_t>(n, width-x);
+            // Right-to-left rows fill the k columns that end where the previous piece began
+            u8 *out = dst + (right_to_left ? width-x-k : x)*bytespp;
+            if (raw && right_to_left) {
+                copy_reversed(out, pixel, k, bytespp);
+                pixel += k*bytespp;
+            } else if (raw) {
+                memcpy(out, pixel, k*bytespp);
+                pixel += k*bytespp;
+            } else {
+                fill_pixels(out, pixel, k, bytespp);
+            }
+            n -= k;
+            x += k;
+            if (x == width) {
+                x = 0;
+                row++;
+                dst = top_down ? dst + row_bytes : dst - row_bytes;
             }
         }
-    } while (currentpixel < pixelcount);
+    }
     return true;
 }
 
 
 
 // TODO: it is not necessary to break a raw chunk for two equal pixels (for the matter of the resulting size)
-bool TGAImage::unload_rle_data(std::ofstream &out) {
+bool TGAImage::unload_rle_data(std::ostream &out) {
+    KTRACE("rle encode");
     const unsigned char max_chunk_length = 128;
     unsigned long npixels = width*height;
     unsigned long curpix = 0;
@@ -269,78 +341,31 @@ int TGAImage::get_height() {
     return height;
 }
 
-bool TGAImage::flip_horizontally() {
-    if (!data) return false;
-    int half = width>>1;
-    for (int i=0; i<half; i++) {
-        for (int j=0; j<height; j++) {
-            TGAColor c1 = get(i, j);
-            TGAColor c2 = get(width-1-i, j);
-            set(i, j, c2);
-            set(width-1-i, j, c1);
-        }
-    }
-    return true;
+bool TGAImage::flip_horizontally(ThreadPool *pool) {
+    return image_flip_horizontally(*this, pool);
 }
 
-bool TGAImage::flip_vertically() {
-    if (!data) return false;
-    unsigned long bytes_per_line = width*bytespp;
-    unsigned char *line = new unsigned char[bytes_per_line];
-    int half = height>>1;
-    for (int j=0; j<half; j++) {
-        unsigned long l1 = j*bytes_per_line;
-        unsigned long l2 = (height-1-j)*bytes_per_line;
-        memmove((void *)line,      (void *)(data+l1), bytes_per_line);
-        memmove((void *)(data+l1), (void *)(data+l2), bytes_per_line);
-        memmove((void *)(data+l2), (void *)line,      bytes_per_line);
-    }
-    delete [] line;
-    return true;
+bool TGAImage::flip_vertically(ThreadPool *pool) {
+    return image_flip_vertically(*this, pool);
 }
 
 unsigned char * TGAImage::buffer() {
     return data;
 }
 
+void TGAImage::adopt(u8 *pixels, int w, int h, int bpp) {
+    if (data && data != pixels) delete [] data;
+    data    = pixels;
+    width   = w;
+    height  = h;
+    bytespp = bpp;
+}
+
 void TGAImage::clear() {
     memset((void *)data, 0, width*height*bytespp);
 }
 
-bool TGAImage::scale(int w, int h) {
-    if (w<=0 || h<=0 || !data) return false;
-    unsigned char *tdata = new unsigned char[w*h*bytespp];
-    int nscanline = 0;
-    int oscanline = 0;
-    int erry = 0;
-    unsigned long nlinebytes = w*bytespp;
-    unsigned long olinebytes = width*bytespp;
-    for (int j=0; j<height; j++) {
-        int errx = width-w;
-        int nx   = -bytespp;
-        int ox   = -bytespp;
-        for (int i=0; i<width; i++) {
-            ox += bytespp;
-            errx += w;
-            while (errx>=(int)width) {
-                errx -= width;
-                nx += bytespp;
-                memcpy(tdata+nscanline+nx, data+oscanline+ox, bytespp);
-            }
-        }
-        erry += h;
-        oscanline += olinebytes;
-        while (erry>=(int)height) {
-            if (erry>=(int)height<<1) // it means we jump over a scanline
-                memcpy(tdata+nscanline+nlinebytes, tdata+nscanline, nlinebytes);
-            erry -= height;
-            nscanline += nlinebytes;
-        }
-    }
-    delete [] data;
-    data   = tdata;
-    width  = w;
-    height = h;
-    return true;
+bool TGAImage::scale(int w, int h, ThreadPool *pool) {
+    return image_scale(*this, w, h, pool);
 }
 
@@ -0,0 +1,249 @@
+#include "includes/kvideo.h"
+#include "includes/ktrace.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <iostream>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+//! BT.601 limited range in 8.8 fixed point, with the offsets folded into the bias so that
+//! every sum lies in [0, 65535]:
+//!     Y = ( 66 R + 129 G +  25 B + 128 + ( 16 << 8)) >> 8
+//!     U = (-38 R -  74 G + 112 B + 128 + (128 << 8)) >> 8
+//!     V = (112 R -  94 G -  18 B + 128 + (128 << 8)) >> 8
+//! Sums can then be taken modulo 2^16, in 16-bit lanes, and still come out exact.
+struct Weights {
+    u16 r, g, b, bias;
+};
+
+const Weights LUMA     = {  66,       129,       25,       128 + (16 << 8)  };
+const Weights CHROMA_B = { u16(-38), u16(-74),  112,       128 + (128 << 8) };
+const Weights CHROMA_R = { 112,      u16(-94),  u16(-18),  128 + (128 << 8) };
+
+//! out[i] = (w.r*r[i] + w.g*g[i] + w.b*b[i] + w.bias) >> 8 for planar 8-bit channels held in u16s.
+void weigh(const u16 *r, const u16 *g, const u16 *b, const Weights &w, u8 *out, int n)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i wr = _mm_set1_epi16(w.r), wg = _mm_set1_epi16(w.g), wb = _mm_set1_epi16(w.b);
+    const __m128i bias = _mm_set1_epi16(w.bias);
+    auto eight = [&](int at) {
+        __m128i sum = _mm_add_epi16(bias, _mm_mullo_epi16(_mm_loadu_si128((const __m128i *)(r + at)), wr));
+        sum = _mm_add_epi16(sum, _mm_mullo_epi16(_mm_loadu_si128((const __m128i *)(g + at)), wg));
+        sum = _mm_add_epi16(sum, _mm_mullo_epi16(_mm_loadu_si128((const __m128i *)(b + at)), wb));
+        return _mm_srli_epi16(sum, 8);
+    };
+    for (; i + 16 <= n; i += 16)
+    {
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(eight(i), eight(i + 8)));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        out[i] = u16(w.r*r[i] + w.g*g[i] + w.b*b[i] + w.bias) >> 8;
+    }
+}
+
+//! Splits a row of BGR pixels into R, G and B planes.
+void split_row(const u8 *bgr, u16 *r, u16 *g, u16 *b, int n)
+{
+    for (int i = 0; i < n; i++, bgr += 3)
+    {
+        b[i] = bgr[0];
+        g[i] = bgr[1];
+        r[i] = bgr[2];
+    }
+}
+
+//! Rounded mean of each 2x2 block of two rows; an odd last column is averaged with itself.
+void average_2x2(const u16 *top, const u16 *bottom, u16 *out, int n)
+{
+    int pairs = n / 2;
+    for (int i = 0; i < pairs; i++)
+    {
+        out[i] = (top[2*i] + top[2*i+1] + bottom[2*i] + bottom[2*i+1] + 2) >> 2;
+    }
+    if (n & 1)
+    {
+        out[pairs] = (2*top[n-1] + 2*bottom[n-1] + 2) >> 2;
+    }
+}
+
+bool write_all(int fd, const u8 *data, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len  -= n;
+    }
+    return true;
+}
+
+}
+
+bool parse_video_format(const char *name, VideoFormat &format)
+{
+    if (!strcmp(name, "y4m"))
+        format = VIDEO_Y4M;
+    else if (!strcmp(name, "rgb"))
+        format = VIDEO_RGB24;
+    else
+        return false;
+    return true;
+}
+
+VideoWriter::VideoWriter(int out_fd, VideoFormat fmt, int w, int h, int rate, size_t depth)
+    : storage(depth), full(depth), empty(depth), fd(out_fd), format(fmt), width(w), height(h), fps(rate),
+      nframes(0), failed(false), finished(false)
+{
+    for (Frame &f : storage)
+    {
+        f.pixels.resize((size_t) width*height*3);
+        empty.push(&f);
+    }
+    for (std::vector<u16> &plane : planes)
+    {
+        plane.resize(width);
+    }
+    writer = std::thread(&VideoWriter::run, this);
+}
+
+VideoWriter::~VideoWriter()
+{
+    finish();
+}
+
+bool VideoWriter::write_frame(TGAImage &frame)
+{
+    if (failed || finished)
+    {
+        return false;
+    }
+    if (frame.get_width() != width || frame.get_height() != height || frame.get_bytespp() != RGB)
+    {
+        std::cerr << "krender: video frames must be " << width << " x " << height << " RGB images.\n";
+        return false;
+    }
+    Frame *f;
+    if (!empty.pop(f))
+    {
+        return false;
+    }
+    {
+        KTRACE("queue frame", nframes);
+        memcpy(f->pixels.data(), frame.buffer(), f->pixels.size());
+    }
+    full.push(f);
+    nframes++;
+    return true;
+}
+
+bool VideoWriter::finish()
+{
+    if (!finished)
+    {
+        full.close();
+        writer.join();
+        finished = true;
+    }
+    return !failed;
+}
+
+void VideoWriter::run()
+{
+    trace_thread_name("video writer");
+    std::vector<u8> out;
+    u64 written = 0;
+    if (format == VIDEO_Y4M)
+    {
+        char header[128];
+        int n = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg XYSCSS=420JPEG\n", width, height, fps);
+        failed = !write_all(fd, (const u8 *)header, n);
+    }
+    Frame *f;
+    while (full.pop(f))
+    {
+        if (!failed)
+        {
+            {
+                KTRACE("encode frame", written);
+                encode(f->pixels.data(), out);
+            }
+            KTRACE("write frame", written++);
+            if (!write_all(fd, out.data(), out.size()))
+            {
+                std::cerr << "krender: error: couldn't write video frame: " << strerror(errno) << "\n";
+                failed = true;
+            }
+        }
+        empty.push(f);
+    }
+}
+
+//! Frames are bottom-up BGR, like every TGAImage the renderer produces; both formats are top-down.
+void VideoWriter::encode(const u8 *pixels, std::vector<u8> &out)
+{
+    size_t row = (size_t) width*3;
+    if (format == VIDEO_RGB24)
+    {
+        out.resize(row*height);
+        for (int y = 0; y < height; y++)
+        {
+            const u8 *src = pixels + (height-1-y)*row;
+            u8 *dst = out.data() + y*row;
+            for (int x = 0; x < width; x++, src += 3, dst += 3)
+            {
+                dst[0] = src[2];
+                dst[1] = src[1];
+                dst[2] = src[0];
+            }
+        }
+        return;
+    }
+
+    static const char marker[] = "FRAME\n";
+    size_t chroma = (size_t) ((width+1)/2) * ((height+1)/2);
+    out.resize(sizeof(marker)-1 + (size_t) width*height + 2*chroma);
+    memcpy(out.data(), marker, sizeof(marker)-1);
+    encode_y4m(pixels, out.data() + sizeof(marker)-1);
+}
+
+//! Two rows of luma and one of each chroma plane at a time.
+void VideoWriter::encode_y4m(const u8 *pixels, u8 *out)
+{
+    int cw = (width+1)/2, ch = (height+1)/2;
+    u8 *luma = out, *cb = luma + (size_t) width*height, *cr = cb + (size_t) cw*ch;
+    u16 *top[3]     = { planes[0].data(), planes[1].data(), planes[2].data() };
+    u16 *bottom[3]  = { planes[3].data(), planes[4].data(), planes[5].data() };
+    u16 *average[3] = { planes[6].data(), planes[7].data(), planes[8].data() };
+    size_t row = (size_t) width*3;
+
+    for (int y = 0; y < height; y += 2)
+    {
+        bool pair = y+1 < height;
+        split_row(pixels + (height-1-y)*row, top[0], top[1], top[2], width);
+        weigh(top[0], top[1], top[2], LUMA, luma + (size_t) y*width, width);
+        if (pair)
+        {
+            split_row(pixels + (height-2-y)*row, bottom[0], bottom[1], bottom[2], width);
+            weigh(bottom[0], bottom[1], bottom[2], LUMA, luma + (size_t) (y+1)*width, width);
+        }
+        for (int c = 0; c < 3; c++)
+        {
+            average_2x2(top[c], pair ? bottom[c] : top[c], average[c], width);
+        }
+        weigh(average[0], average[1], average[2], CHROMA_B, cb + (size_t) (y/2)*cw, cw);
+        weigh(average[0], average[1], average[2], CHROMA_R, cr + (size_t) (y/2)*cw, cw);
+    }
+}
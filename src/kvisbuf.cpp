@@ -0,0 +1,134 @@
+#include "includes/kvisbuf.h"
+#include "includes/kraster.h"
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+void visibility_clear(VisibilityTarget &target)
+{
+    for (int y = 0; y < target.y1 - target.y0; y++)
+    {
+        std::fill_n(target.ids + y*target.pitch, target.x1 - target.x0, 0u);
+        std::fill_n(target.depth + y*target.depth_pitch, target.x1 - target.x0, -std::numeric_limits<float>::max());
+    }
+}
+
+void visibility_pass(const MeshView &view, VisibilityTarget &target)
+{
+    // The id buffer is written like a 4-byte color target
+    RenderTarget ids;
+    ids.pixels      = (u8 *) target.ids;
+    ids.pitch       = target.pitch*sizeof(u32);
+    ids.bytespp     = sizeof(u32);
+    ids.depth       = target.depth;
+    ids.depth_pitch = target.depth_pitch;
+    ids.x0 = target.x0;
+    ids.y0 = target.y0;
+    ids.x1 = target.x1;
+    ids.y1 = target.y1;
+
+    RasterFunction raster = raster_function(SHADE_ID, sizeof(u32));
+    RasterTriangle tri;
+    for (size_t f = 0; f < view.ntris; f++)
+    {
+        const u32 *face = view.tris + 3*f;
+        const Vec3f &a = view.screen[face[0]], &b = view.screen[face[1]], &c = view.screen[face[2]];
+        float min_y = std::min(a.y, std::min(b.y, c.y)), max_y = std::max(a.y, std::max(b.y, c.y));
+        float min_x = std::min(a.x, std::min(b.x, c.x)), max_x = std::max(a.x, std::max(b.x, c.x));
+        if (max_y < target.y0-1 || min_y >= target.y1+1 || max_x < target.x0-1 || min_x >= target.x1+1) continue;
+
+        snap_face(view.screen, face, tri.pts);
+        if (is_subpixel(tri.pts)) continue;
+        tri.id = view.face_id(f) + 1;
+        raster(tri, ids);
+    }
+}
+
+namespace {
+//! Everything about a face that does not depend on the pixel, rebuilt when the id changes
+struct FaceSetup {
+    u32   id;
+    Vec3f pts[3];
+    float flat;         // Face-normal intensity
+    float lod;          // Mip level, constant over an affine-mapped face
+};
+}
+
+//! log2 of the texels stepped over per pixel, from the screen-space gradients of uv
+static float texture_lod(const Vec3f *pts, const Vec2f *uv, const Texture &texture)
+{
+    float area = (pts[1].x-pts[0].x)*(pts[2].y-pts[0].y) - (pts[1].y-pts[0].y)*(pts[2].x-pts[0].x);
+    if (std::abs(area) < 1e-6f) return 0;
+    Vec2f d1 = uv[1] - uv[0], d2 = uv[2] - uv[0];
+    float dudx = (d1.x*(pts[2].y-pts[0].y) - d2.x*(pts[1].y-pts[0].y)) / area;
+    float dvdx = (d1.y*(pts[2].y-pts[0].y) - d2.y*(pts[1].y-pts[0].y)) / area;
+    float dudy = (d2.x*(pts[1].x-pts[0].x) - d1.x*(pts[2].x-pts[0].x)) / area;
+    float dvdy = (d2.y*(pts[1].x-pts[0].x) - d1.y*(pts[2].x-pts[0].x)) / area;
+    float w = texture.width(), h = texture.height();
+    float rho2 = std::max(dudx*dudx*w*w + dvdx*dvdx*h*h, dudy*dudy*w*w + dvdy*dvdy*h*h);
+    return rho2 > 1 ? .5f*std::log2(rho2) : 0;
+}
+
+void deferred_shade(const VisibilityTarget &vis, const Model &model, const Vec3f *world, const Vec3f *screen,
+                    float theta, const Texture *texture, RenderTarget &out)
+{
+    const bool  smooth    = model.has_normals();
+    const bool  textured  = texture && texture->ok() && model.has_texcoords();
+    const float cos_theta = cos(theta), sin_theta = sin(theta);
+
+    FaceSetup setup;
+    setup.id = 0;
+    for (int y = out.y0; y < out.y1; y++)
+    {
+        const u32 *idrow = vis.ids + (y - vis.y0)*vis.pitch - vis.x0;
+        u8 *row = out.pixels + (y - out.y0)*out.pitch - out.x0*out.bytespp;
+        for (int x = out.x0; x < out.x1; x++)
+        {
+            u32 id = idrow[x];
+            if (!id) continue;
+            const u32 *face = model.tris.data() + 3*(id - 1);
+            if (id != setup.id)
+            {
+                setup.id = id;
+                snap_face(screen, face, setup.pts);
+                setup.flat = smooth ? 0 : face_intensity(world, face);
+                if (textured)
+                {
+                    const u32 *ft = model.tri_uvs.data() + 3*(id - 1);
+                    Vec2f uv[3] = { model.uvs[ft[0]], model.uvs[ft[1]], model.uvs[ft[2]] };
+                    setup.lod = texture_lod(setup.pts, uv, *texture);
+                }
+            }
+
+            Vec3f bc;
+            if (smooth || textured)
+            {
+                bc = get_bar_coord(setup.pts[0], setup.pts[1], setup.pts[2], Vec3f(x, y, 0));
+            }
+            float intensity = setup.flat;
+            if (smooth)
+            {
+                const u32 *fn = model.tri_norms.data() + 3*(id - 1);
+                Vec3f n = model.norms[fn[0]]*bc.x + model.norms[fn[1]]*bc.y + model.norms[fn[2]]*bc.z;
+                // Vertex normals point out of the model; only their rotated z matters for a light along -z
+                intensity = (n.z*cos_theta + n.x*sin_theta) / n.norm();
+            }
+            intensity = std::max(0.f, std::min(1.f, intensity));
+
+            TGAColor color;
+            if (textured)
+            {
+                const u32 *ft = model.tri_uvs.data() + 3*(id - 1);
+                Vec2f uv = model.uvs[ft[0]]*bc.x + model.uvs[ft[1]]*bc.y + model.uvs[ft[2]]*bc.z;
+                color = texture->sample(uv.x, uv.y, setup.lod);
+                for (int c = 0; c < 3; c++) color.raw[c] = color.raw[c]*intensity;
+            }
+            else
+            {
+                u8 v = intensity*255;
+                color = TGAColor(v, v, v, 255);
+            }
+            std::copy(color.raw, color.raw + out.bytespp, row + x*out.bytespp);
+        }
+    }
+}
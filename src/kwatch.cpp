@@ -0,0 +1,373 @@
+#include "includes/kwatch.h"
+#include "includes/kcontext.h"
+#include "includes/kio.h"
+#include "includes/ktrace.h"
+#include <signal.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using std::cerr;
+using std::vector;
+
+namespace {
+
+const int    OUTPUTS    = 3;
+const int    WATCH_TILE = 32;   // Pixels per side of the tiles changes are tracked in
+const size_t MAX_RECTS  = 16;   // More dirty rectangles than this are redrawn as one
+const std::chrono::milliseconds POLL(100);
+
+volatile sig_atomic_t interrupted = 0;
+
+void on_interrupt(int)
+{
+    interrupted = 1;
+}
+
+//! Enough of a file's metadata to tell that it was written to
+struct Stamp {
+    bool   exists;
+    time_t seconds;
+    long   nanoseconds;
+    off_t  size;
+
+    bool operator ==(const Stamp &o) const
+    {
+        return exists == o.exists && seconds == o.seconds && nanoseconds == o.nanoseconds && size == o.size;
+    }
+    bool operator !=(const Stamp &o) const { return !(*this == o); }
+};
+
+Stamp stamp_of(const char *path)
+{
+    Stamp s = Stamp();
+    struct stat st;
+    if (!stat(path, &st))
+    {
+        s.exists      = true;
+        s.seconds     = st.st_mtim.tv_sec;
+        s.nanoseconds = st.st_mtim.tv_nsec;
+        s.size        = st.st_size;
+    }
+    return s;
+}
+
+//! Pixels [x0, x1) x [y0, y1)
+struct Rect {
+    int x0, y0, x1, y1;
+};
+
+//! Clamped to [-1, limit+1] before the conversion, which also turns NaN into -1
+int to_pixel(float v, int limit)
+{
+    return std::max(-1.f, std::min(v, limit + 1.f));
+}
+
+//! Every pixel any pass may draw for a face: its screen box, widened by the pixel that
+//! rounding or truncating its corners can move it.
+Rect face_box(const Vec3f *screen, const u32 *face, int width, int height)
+{
+    const Vec3f &a = screen[face[0]], &b = screen[face[1]], &c = screen[face[2]];
+    Rect r;
+    r.x0 = to_pixel(std::floor(std::min(a.x, std::min(b.x, c.x))) - 1, width);
+    r.x1 = to_pixel(std::ceil (std::max(a.x, std::max(b.x, c.x))) + 2, width);
+    r.y0 = to_pixel(std::floor(std::min(a.y, std::min(b.y, c.y))) - 1, height);
+    r.y1 = to_pixel(std::ceil (std::max(a.y, std::max(b.y, c.y))) + 2, height);
+    return r;
+}
+
+bool overlaps(const Rect &a, const Rect &b)
+{
+    return a.x0 < b.x1 && b.x0 < a.x1 && a.y0 < b.y1 && b.y0 < a.y1;
+}
+
+//! WATCH_TILE x WATCH_TILE tiles of the frame that need to be redrawn
+class DirtyTiles {
+public:
+    DirtyTiles(int w, int h)
+        : width(w), height(h), cols((w + WATCH_TILE - 1) / WATCH_TILE), rows((h + WATCH_TILE - 1) / WATCH_TILE),
+          dirty(cols*rows, false) { }
+
+    void mark(const Rect &r)
+    {
+        int x0 = std::max(0, r.x0), x1 = std::min(width, r.x1);
+        int y0 = std::max(0, r.y0), y1 = std::min(height, r.y1);
+        if (x0 >= x1 || y0 >= y1) return;
+        for (int ty = y0 / WATCH_TILE; ty <= (y1-1) / WATCH_TILE; ty++)
+            for (int tx = x0 / WATCH_TILE; tx <= (x1-1) / WATCH_TILE; tx++)
+                dirty[ty*cols + tx] = true;
+    }
+
+    //! Runs of dirty tiles along each row of tiles, stacked while the rows below have the
+    //! same run. Too many of them are merged into their bounding box.
+    vector<Rect> rects() const
+    {
+        vector<Rect> out;
+        for (int ty = 0; ty < rows; ty++)
+        {
+            int y0 = ty*WATCH_TILE, y1 = std::min(height, y0 + WATCH_TILE);
+            for (int tx = 0; tx < cols; )
+            {
+                if (!dirty[ty*cols + tx]) { tx++; continue; }
+                int end = tx;
+                while (end < cols && dirty[ty*cols + end]) end++;
+                Rect run = { tx*WATCH_TILE, y0, std::min(width, end*WATCH_TILE), y1 };
+                auto above = std::find_if(out.begin(), out.end(), [&](const Rect &r) {
+                    return r.y1 == y0 && r.x0 == run.x0 && r.x1 == run.x1;
+                });
+                if (above != out.end())
+                    above->y1 = y1;
+                else
+                    out.push_back(run);
+                tx = end;
+            }
+        }
+        if (out.size() > MAX_RECTS)
+        {
+            Rect all = out[0];
+            for (const Rect &r : out)
+            {
+                all.x0 = std::min(all.x0, r.x0);
+                all.y0 = std::min(all.y0, r.y0);
+                all.x1 = std::max(all.x1, r.x1);
+                all.y1 = std::max(all.y1, r.y1);
+            }
+            out.assign(1, all);
+        }
+        return out;
+    }
+
+private:
+    int          width, height, cols, rows;
+    vector<bool> dirty;
+};
+
+//! The model the outputs currently show, and its vertices as the renderer placed them
+struct Shown {
+    std::shared_ptr<const Model> model;
+    vector<Vec3f>                world, screen;
+    float                        zmin, zmax;
+};
+
+void place(Shown &shown, const Camera &camera, u32 width, u32 height)
+{
+    const Model &m = *shown.model;
+    shown.world.resize(m.verts.size());
+    shown.screen.resize(m.verts.size());
+    transform_vertices(m.verts.data(), m.verts.size(), camera, width, height, shown.world.data(), shown.screen.data());
+    shown.zmin =  std::numeric_limits<float>::max();
+    shown.zmax = -std::numeric_limits<float>::max();
+    for (const Vec3f &v : shown.world)
+    {
+        shown.zmin = std::min(shown.zmin, v.z);
+        shown.zmax = std::max(shown.zmax, v.z);
+    }
+}
+
+bool same(const Vec3f &a, const Vec3f &b) { return a.x == b.x && a.y == b.y && a.z == b.z; }
+bool same(const Vec2f &a, const Vec2f &b) { return a.x == b.x && a.y == b.y; }
+
+//! Compares what face fa of a and face fb of b refer to rather than the indices they use.
+//! Both models must agree on having normals and texture coordinates.
+bool same_face(const Model &a, const Model &b, size_t fa, size_t fb)
+{
+    for (int k = 0; k < 3; k++)
+    {
+        size_t i = 3*fa + k, j = 3*fb + k;
+        if (!same(a.verts[a.tris[i]], b.verts[b.tris[j]]))
+            return false;
+        if (a.has_normals() && !same(a.norms[a.tri_norms[i]], b.norms[b.tri_norms[j]]))
+            return false;
+        if (a.has_texcoords() && !same(a.uvs[a.tri_uvs[i]], b.uvs[b.tri_uvs[j]]))
+            return false;
+    }
+    return true;
+}
+
+//! Marks where faces changed between before and after, returning how many did.
+//!
+//! Faces are matched in order, the way a line diff matches lines: first the unchanged runs at
+//! both ends, so that one block inserted or deleted anywhere leaves everything else matched,
+//! then, between them, by looking up to RESYNC faces ahead on either side whenever a pair
+//! differs. Unmatched faces on either side are marked. A pixel away from all of them is
+//! covered by the same faces in the same order as before, and none of the outputs depends on
+//! anything else, face indices included.
+size_t diff(const Shown &before, const Shown &after, int width, int height, DirtyTiles &tiles)
+{
+    KTRACE("diff");
+    const size_t RESYNC = 16;
+    const Model &a = *before.model, &b = *after.model;
+    size_t na = a.nfaces(), nb = b.nfaces();
+    while (na && nb && same_face(a, b, na-1, nb-1))
+    {
+        na--;
+        nb--;
+    }
+
+    size_t i = 0, j = 0, changed = 0;
+    auto mark = [&](size_t skip_a, size_t skip_b) {
+        for (size_t end = i + skip_a; i < end; i++)
+            tiles.mark(face_box(before.screen.data(), a.tris.data() + 3*i, width, height));
+        for (size_t end = j + skip_b; j < end; j++)
+            tiles.mark(face_box(after.screen.data(), b.tris.data() + 3*j, width, height));
+        changed += std::max(skip_a, skip_b);
+    };
+    while (i < na && j < nb)
+    {
+        if (same_face(a, b, i, j))
+        {
+            i++;
+            j++;
+            continue;
+        }
+        size_t skip_a = 1, skip_b = 1;
+        for (size_t d = 1; d <= RESYNC; d++)
+        {
+            if (i + d < na && same_face(a, b, i + d, j)) { skip_a = d; skip_b = 0; break; }     // Deleted
+            if (j + d < nb && same_face(a, b, i, j + d)) { skip_a = 0; skip_b = d; break; }     // Inserted
+        }
+        mark(skip_a, skip_b);
+    }
+    mark(na - i, nb - j);
+    return changed;
+}
+
+//! Whether a change can touch pixels away from the faces that changed
+bool needs_full_render(const Shown &before, const Shown &after, const config_t &cfg)
+{
+    const Model &a = *before.model, &b = *after.model;
+    // Deferred shading picks smooth or textured shading for the whole model
+    if (a.has_normals() != b.has_normals() || a.has_texcoords() != b.has_texcoords())
+        return true;
+    // Multisampled depth is quantized over the model's depth range
+    return cfg.samples > 1 && (before.zmin != after.zmin || before.zmax != after.zmax);
+}
+
+}
+
+int run_watch(const config_t &cfg)
+{
+    const char *names[OUTPUTS] = { "output-wireframe.tga", "output-gouraud-no-z.tga", "output-gourand-with-z.tga" };
+    const RenderMode modes[OUTPUTS] = { WIREFRAME, GOURAUD, cfg.deferred ? DEFERRED : GOURAUD_Z };
+
+    RenderContext ctx(cfg.threads);
+    ctx.set_samples(cfg.samples);
+    ctx.set_view(cfg.center_x, cfg.center_y, cfg.zoom);
+    ctx.set_rotation(cfg.rotation);
+    if (cfg.texture_file && !ctx.load_texture(cfg.texture_file))
+    {
+        return 1;
+    }
+    Camera camera;
+    camera.theta = cfg.rotation;
+    camera.cx    = cfg.center_x;
+    camera.cy    = cfg.center_y;
+    camera.zoom  = cfg.zoom;
+
+    Stamp stamp = stamp_of(cfg.obj_file);
+    Shown shown;
+    shown.model = std::make_shared<Model>(cfg.obj_file);
+    if (shown.model->verts.empty())
+    {
+        return 1;
+    }
+    place(shown, camera, cfg.width, cfg.height);
+    ctx.set_model(shown.model);
+
+    TGAImage images[OUTPUTS];
+    for (int i = 0; i < OUTPUTS; i++)
+    {
+        images[i] = TGAImage(cfg.width, cfg.height, RGB);
+        ctx.render(modes[i], cfg.width, cfg.height, image_target(images[i]));
+        save_result(images[i], names[i], true, &ctx.thread_pool());
+    }
+
+    signal(SIGINT,  on_interrupt);
+    signal(SIGTERM, on_interrupt);
+    cerr << "krender: watching \"" << cfg.obj_file << "\" for changes; press Ctrl-C to stop.\n";
+    while (!interrupted)
+    {
+        std::this_thread::sleep_for(POLL);
+        Stamp now = stamp_of(cfg.obj_file);
+        if (now == stamp)
+            continue;
+        // Editors may write in several steps, or replace the file; wait until it settles
+        do
+        {
+            stamp = now;
+            std::this_thread::sleep_for(POLL);
+            now = stamp_of(cfg.obj_file);
+        } while (now != stamp && !interrupted);
+        if (!now.exists || interrupted)
+            continue;
+
+        KTRACE("watch update");
+        auto start = std::chrono::steady_clock::now();
+        Shown next;
+        next.model = std::make_shared<Model>(cfg.obj_file);
+        if (next.model->verts.empty())
+        {
+            cerr << "krender: keeping the previous version of \"" << cfg.obj_file << "\".\n";
+            continue;
+        }
+        place(next, camera, cfg.width, cfg.height);
+        auto parsed = std::chrono::steady_clock::now();
+
+        DirtyTiles tiles(cfg.width, cfg.height);
+        bool full = needs_full_render(shown, next, cfg);
+        size_t changed = full ? next.model->nfaces() : diff(shown, next, cfg.width, cfg.height, tiles);
+        vector<Rect> rects;
+        if (full)
+            rects.push_back(Rect { 0, 0, int(cfg.width), int(cfg.height) });
+        else
+            rects = tiles.rects();
+        ctx.set_model(next.model);
+        shown = std::move(next);
+
+        // Every face of the new model that may reach a dirty rectangle is drawn again, in order
+        vector<vector<u32>> faces(rects.size());
+        if (!full)
+        {
+            const Model &m = *shown.model;
+            for (size_t f = 0; f < m.nfaces(); f++)
+            {
+                Rect box = face_box(shown.screen.data(), m.tris.data() + 3*f, cfg.width, cfg.height);
+                for (size_t r = 0; r < rects.size(); r++)
+                    if (overlaps(box, rects[r])) faces[r].push_back(f);
+            }
+        }
+        size_t pixels = 0;
+        for (size_t r = 0; r < rects.size(); r++)
+        {
+            const Rect &rect = rects[r];
+            pixels += (size_t) (rect.x1 - rect.x0) * (rect.y1 - rect.y0);
+            for (int i = 0; i < OUTPUTS; i++)
+            {
+                RenderTarget target = image_target(images[i]);
+                target.pixels += rect.y0*target.pitch + rect.x0*target.bytespp;
+                target.x0 = rect.x0;
+                target.y0 = rect.y0;
+                target.x1 = rect.x1;
+                target.y1 = rect.y1;
+                ctx.render_faces(modes[i], cfg.width, cfg.height, target, full ? NULL : &faces[r]);
+            }
+        }
+        double parse_ms  = std::chrono::duration<double, std::milli>(parsed - start).count();
+        double render_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - parsed).count();
+        cerr << "krender: " << changed << " of " << shown.model->nfaces() << " faces changed; redrew " << pixels
+             << " pixels in " << rects.size() << " rectangle(s) in " << render_ms << " ms, after reading the model in " << parse_ms << " ms.\n";
+        if (rects.empty())
+            continue;
+        for (int i = 0; i < OUTPUTS; i++)
+        {
+            save_result(images[i], names[i], true, &ctx.thread_pool());
+        }
+    }
+    return 0;
+}
@@ -1,28 +1,313 @@
 #include "includes/ktypes.h"
-#include "includes/krender.h"
+#include "includes/kcontext.h"
+#include "includes/kraster.h"
 #include "includes/kio.h"
+#include "includes/kserver.h"
+#include "includes/ktrace.h"
+#include "includes/kdist.h"
+#include "includes/kvideo.h"
+#include "includes/kwatch.h"
+#include "includes/kcomposite.h"
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <chrono>
+#include <cmath>
+#include <string>
 
-const TGAColor white = TGAColor(255, 255, 255, 255);
-const TGAColor red   = TGAColor(255, 0,   0,   255);
+//! An image holding the whole frame, or just its --crop rectangle
+static TGAImage frame_image(const config_t &cfg)
+{
+    if (!cfg.crop_set)
+    {
+        return TGAImage(cfg.width, cfg.height, RGB);
+    }
+    return TGAImage(cfg.crop[2]-cfg.crop[0], cfg.crop[3]-cfg.crop[1], RGB);
+}
+
+static RenderTarget frame_target(TGAImage &image, const config_t &cfg, float *depth = NULL)
+{
+    RenderTarget target = image_target(image, depth);
+    if (cfg.crop_set)
+    {
+        target.x0 = cfg.crop[0];
+        target.y0 = cfg.crop[1];
+        target.x1 = cfg.crop[2];
+        target.y1 = cfg.crop[3];
+    }
+    return target;
+}
+
+static TGAImage render_image(RenderContext &ctx, RenderMode mode, const config_t &cfg)
+{
+    TGAImage image = frame_image(cfg);
+    ctx.render(mode, cfg.width, cfg.height, frame_target(image, cfg));
+    return image;
+}
+
+//! Renders the z-buffered output as cfg.partitions spatial partitions of the loaded model, then
+//! adds the --merge layers, compositing them by depth in tree order as they are ready. With
+//! --partition the loaded model is already just one partition (see load_partition) and is
+//! rendered whole. Saves the depth if asked to.
+static bool render_layered(RenderContext &ctx, RenderMode mode, const config_t &cfg, TGAImage &out)
+{
+    int partitions = cfg.partition_set ? 1 : std::max<u32>(cfg.partitions, 1);
+    vector<vector<u32>> faces;
+    if (partitions > 1)
+    {
+        faces = partition_faces(*ctx.get_model(), partitions);
+    }
+    vector<std::string> files;
+    for (const char *p = cfg.merge_layers; p && *p; )
+    {
+        const char *comma = strchr(p, ',');
+        files.push_back(comma ? std::string(p, comma) : std::string(p));
+        p = comma ? comma + 1 : "";
+    }
+
+    LayerTree tree(&ctx.thread_pool());
+    Layer     result, layer;
+    int       layers = 0;
+    double    ms     = 0;
+    auto merge = [&]() {
+        auto start = std::chrono::steady_clock::now();
+        bool ok = tree.add(layer);
+        ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        layers++;
+        return ok;
+    };
+    for (int k = 0; k < partitions; k++)
+    {
+        // Layers the tree has merged away come back in layer, so after the first few nothing is allocated
+        if (!layer.color.get_width())
+        {
+            layer.color = frame_image(cfg);
+            layer.depth.resize((size_t) layer.color.get_width()*layer.color.get_height());
+        }
+        ctx.render_faces(mode, cfg.width, cfg.height, frame_target(layer.color, cfg, layer.depth.data()), partitions > 1 ? &faces[k] : NULL);
+        if (!merge())
+        {
+            return false;
+        }
+    }
+    for (size_t i = 0; i + 1 < files.size(); i += 2)
+    {
+        if (!load_layer(files[i].c_str(), files[i+1].c_str(), layer, &ctx.thread_pool()) || !merge())
+        {
+            return false;
+        }
+    }
+    auto start = std::chrono::steady_clock::now();
+    if (!tree.finish(result))
+    {
+        return false;
+    }
+    ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (layers > 1)
+    {
+        std::cerr << "krender: composited " << layers << " layers in " << ms << " ms.\n";
+    }
+    if (cfg.depth_file && !save_depth(result.depth.data(), result.color.get_width(), result.color.get_height(), cfg.depth_file))
+    {
+        return false;
+    }
+    out = result.color;
+    return true;
+}
+
+//! Saves every pass of a progressive render, the previews as <name>.pass<n>.tga
+static void render_progressive(RenderContext &ctx, RenderMode mode, const config_t &cfg, const std::string &name)
+{
+    auto start = std::chrono::steady_clock::now();
+    ctx.render_progressive(mode, cfg.width, cfg.height, [&](int pass, int passes, TGAImage &image) {
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cerr << "krender: " << name << " pass " << pass+1 << "/" << passes << " (" << image.get_width() << " x " << image.get_height() << ") after " << ms << " ms.\n";
+        if (pass + 1 < passes)
+            save_result(image, (name + ".pass" + std::to_string(pass+1) + ".tga").c_str(), true, &ctx.thread_pool());
+        else
+            save_result(image, (name + ".tga").c_str(), true, &ctx.thread_pool());
+    });
+}
+
+static void report_compact(const CompactMesh &mesh, const config_t &cfg)
+{
+    size_t full = mesh.nverts()*sizeof(Vec3f) + mesh.nfaces()*3*sizeof(u32);
+    Camera camera;
+    camera.zoom = cfg.zoom;
+    float error = mesh.pixel_error(camera, cfg.width, cfg.height);
+    std::cerr << "krender: compact model takes " << mesh.bytes() / 1024 << " KiB instead of " << full / 1024 << " KiB; "
+              << mesh.wide_clusters() << " of " << mesh.nclusters() << " face clusters need 32-bit indices.\n";
+    std::cerr << "krender: quantized vertices are at most " << error << " pixels off at " << cfg.width << " x " << cfg.height << ".\n";
+    if (error >= .5f)
+    {
+        std::cerr << "krender: warning: quantization error is not sub-pixel at this resolution; drop --compact for an exact render.\n";
+    }
+}
+
+//! Every face is counted once per z-buffered render it reaches, whatever the thread count.
+//! Multisampled passes have their own rasterizer and are not counted.
+static void report_raster_stats(const config_t &cfg)
+{
+    if (!cfg.stats)
+        return;
+    RasterStats stats = raster_stats();
+    u64 total = 0;
+    for (int c = 0; c < RASTER_CLASSES; c++)
+        total += stats.triangles[c];
+    const char *names[RASTER_CLASSES] = { "sub-pixel", "tiny", "general" };
+    for (int c = 0; c < RASTER_CLASSES; c++)
+    {
+        std::cerr << "krender: " << names[c] << " triangles: " << stats.triangles[c];
+        if (total)
+            std::cerr << " (" << 100.*stats.triangles[c]/total << "%)";
+        std::cerr << "\n";
+    }
+}
+
+//! Renders cfg.frames views of a full turn straight into a video, the next frame rendering
+//! while the previous one is converted and written.
+static int render_video(RenderContext &ctx, RenderMode mode, const config_t &cfg)
+{
+    int fd = STDOUT_FILENO;
+    if (strcmp(cfg.video_file, "-"))
+    {
+        fd = open(cfg.video_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            std::cerr << "krender: fatal: couldn't open \"" << cfg.video_file << "\".\n";
+            return 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    auto start = std::chrono::steady_clock::now();
+    TGAImage image = frame_image(cfg);
+    VideoWriter video(fd, (VideoFormat) cfg.video_format, image.get_width(), image.get_height(), cfg.fps);
+    for (u32 i = 0; i < cfg.frames; i++)
+    {
+        ctx.set_rotation(cfg.rotation + 2*M_PI*i/cfg.frames);
+        ctx.render(mode, cfg.width, cfg.height, frame_target(image, cfg));
+        if (!video.write_frame(image))
+            break;
+    }
+    bool ok = video.finish() && video.frames() == cfg.frames;
+    report_raster_stats(cfg);
+    if (fd != STDOUT_FILENO)
+    {
+        close(fd);
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "krender: wrote " << video.frames() << " frame(s) in " << ms << " ms.\n";
+    return ok ? 0 : 1;
+}
 
 int main(int argc, char ** argv) {
     config_t cfg = parse_cli_input(argc, argv);
-    Model model = Model(cfg.obj_file);
-    if (cfg.rotation_set)
+    if (cfg.trace_file)
+    {
+        trace_start(cfg.trace_file);
+    }
+    raster_stats_enable(cfg.stats);
+    if (cfg.server_mode)
+    {
+        return run_server(cfg);
+    }
+    if (cfg.workers)
+    {
+        return run_coordinator(cfg);
+    }
+    if (cfg.watch)
+    {
+        return run_watch(cfg);
+    }
+
+    RenderContext ctx(cfg.threads);
+    ctx.set_samples(cfg.samples);
+    ctx.set_view(cfg.center_x, cfg.center_y, cfg.zoom);
+    if (cfg.rotation_set && !cfg.video_file)
     {
         std::cout << "krender: rotating with theta = " << cfg.rotation << ".\n";
-        model.rotate(cfg.rotation);
+        ctx.set_rotation(cfg.rotation);
+    }
+
+    if (cfg.streaming)
+    {
+        TGAImage     images[3]  = { frame_image(cfg), frame_image(cfg), frame_image(cfg) };
+        RenderMode   modes[3]   = { WIREFRAME, GOURAUD, GOURAUD_Z };
+        RenderTarget targets[3] = { frame_target(images[0], cfg), frame_target(images[1], cfg), frame_target(images[2], cfg) };
+        if (!ctx.render_streaming(cfg.obj_file, cfg.width, cfg.height, modes, targets, 3))
+        {
+            return 1;
+        }
+        save_result(images[0], "output-wireframe.tga", true, &ctx.thread_pool());
+        save_result(images[1], "output-gouraud-no-z.tga", true, &ctx.thread_pool());
+        save_result(images[2], "output-gourand-with-z.tga", true, &ctx.thread_pool());
+        report_raster_stats(cfg);
+        return 0;
     }
 
-    TGAImage wireframe    = draw_wireframe(model, cfg, white);             // Draws wireframe
-    TGAImage   gouraud    = apply_gouraud_shade_no_z_buffer(model, cfg);   // Applies Gouraud shading without z-buffering
-    //TGAImage   z_buffered   = triangle_fill_random_colors(model, cfg);
-    TGAImage  gouraud_z   = apply_gouraud_shade_z_buffer(model, cfg);      // Applies Gouraud shading with z-buffering
+    if (cfg.compact)
+    {
+        if (!ctx.load_compact_model(cfg.obj_file))
+        {
+            return 1;
+        }
+        report_compact(*ctx.get_compact_model(), cfg);
+    }
+    else if (cfg.partition_set)
+    {
+        std::shared_ptr<Model> part = std::make_shared<Model>();
+        if (!load_partition(cfg.obj_file, cfg.partition, cfg.partitions, *part))
+        {
+            return 1;
+        }
+        ctx.set_model(part);
+    }
+    else if (!ctx.load_model(cfg.obj_file))
+    {
+        return 1;
+    }
+    if (cfg.texture_file && !ctx.load_texture(cfg.texture_file))
+    {
+        return 1;
+    }
+
+    if (cfg.video_file)
+    {
+        return render_video(ctx, cfg.deferred ? DEFERRED : GOURAUD_Z, cfg);
+    }
+
+    if (cfg.progressive)
+    {
+        render_progressive(ctx, WIREFRAME, cfg, "output-wireframe");
+        render_progressive(ctx, GOURAUD,   cfg, "output-gouraud-no-z");
+        render_progressive(ctx, cfg.deferred ? DEFERRED : GOURAUD_Z, cfg, "output-gourand-with-z");
+        report_raster_stats(cfg);
+        return 0;
+    }
+
+    TGAImage wireframe    = render_image(ctx, WIREFRAME, cfg);      // Draws wireframe
+    TGAImage   gouraud    = render_image(ctx, GOURAUD,   cfg);      // Applies Gouraud shading without z-buffering
+    //TGAImage   z_buffered   = render_image(ctx, RANDOM_COLORS, cfg);
+    TGAImage  gouraud_z;      // Applies Gouraud shading with z-buffering
+    if (cfg.partitions > 1 || cfg.partition_set || cfg.depth_file || cfg.merge_layers)
+    {
+        if (!render_layered(ctx, cfg.deferred ? DEFERRED : GOURAUD_Z, cfg, gouraud_z))
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        gouraud_z = render_image(ctx, cfg.deferred ? DEFERRED : GOURAUD_Z, cfg);
+    }
 
 
-    save_result(wireframe, "output-wireframe.tga");
-    save_result(gouraud,   "output-gouraud-no-z.tga");
+    save_result(wireframe, "output-wireframe.tga", true, &ctx.thread_pool());
+    save_result(gouraud,   "output-gouraud-no-z.tga", true, &ctx.thread_pool());
     //save_result(z_buffered,   "output-random-colors.tga");
-    save_result(gouraud_z,   "output-gourand-with-z.tga");
+    save_result(gouraud_z,   "output-gourand-with-z.tga", true, &ctx.thread_pool());
+    report_raster_stats(cfg);
     return 0;
 }